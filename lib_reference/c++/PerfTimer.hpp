@@ -27,221 +27,3964 @@
 /*
  * This file is presented as a reference implementation for a performance timer
  * using the perf_timer format. This presentation is a 100% usable implementation
- * of the perf timer; however, it is somewhat naiive about multithreading, using
- * std::mutex to guard events rather than using a more tailored solution such as
- * a concurrent queue. This decision was made to keep the reference implementation as
- * simple as possible, but it should be fairly trivial to change it to use a concurrent queue.
+ * of the perf timer. The default multithreaded mode is deliberately naiive, using
+ * std::mutex to guard events; this keeps the reference implementation as simple
+ * as possible, but two more tailored backends are available for applications where
+ * that mutex shows up in profiles: PERFTIMER_THREAD_BUFFERS (described below) and
+ * PERFTIMER_BACKEND_LOCKFREE, which replaces the guarded buffer chain with a
+ * lock-free multi-producer chain of ring buffers. With the lock-free backend,
+ * recording an event claims a slot with a single atomic increment; a
+ * compare-and-swap is only involved on the (rare) boundary where a buffer fills
+ * and the next one is linked in.
  * 
  * Note that by default, multithreading is not enabled to avoid taking the cost in
  * single-threaded apps. You can control this by defining PERFTIMER_MULTITHREADED
  * to true before including the header, or by modifying the header. (It's recomended
  * to set this in the makefile or other build settings to ensure it's applied consistently
  * to all headers or you may have crashes.)
- * 
+ *
+ * When multithreading is enabled, you can additionally define PERFTIMER_THREAD_BUFFERS
+ * to true to give each thread its own thread_local buffer chain instead of guarding one
+ * shared chain with a mutex. Recording an event then requires no cross-thread
+ * synchronization at all - the only lock remaining is taken once per thread (to register
+ * the thread's chain with the recorder) and once at Write() (to walk the registered
+ * chains). This is strongly recommended for heavily-threaded applications, where the
+ * shared mutex otherwise serializes every instrumented scope in the process.
+ *
+ * By default every event is held in memory until End(), which suits short captures
+ * but not long-running services. Defining PERFTIMER_STREAMING to true starts a
+ * dedicated flusher thread at Start() that takes each buffer as it fills and appends
+ * it to the output file immediately, so steady-state memory stays at roughly one
+ * in-flight buffer per recording thread and End() only has to flush the tail. The
+ * flusher patches the event count into the file header when the capture ends, so the
+ * on-disk format is unchanged.
+ *
+ * A session does not have to end as one monolithic file. EventRecorder::Checkpoint
+ * ("segment_0001.bin") writes everything recorded so far into its own
+ * self-contained capture file and keeps recording, so a week-long soak run can
+ * checkpoint every few minutes and produce bounded-size segments, each of which
+ * parses like any standalone capture. With streaming the rotation happens on the
+ * flusher thread; with the default mutex backend the buffer chain is swapped out
+ * under the recorder lock and written from the calling thread. The flight recorder
+ * covers the same need with Dump(), and the remaining backends record without any
+ * lock under which a consistent chain could be detached, so there the method is
+ * not compiled.
+ *
+ * The streaming flusher can also feed a live viewer instead of a file. On POSIX
+ * systems, defining PERFTIMER_SOCKET to true (alongside PERFTIMER_STREAMING) adds
+ * EventRecorder::StartSocket("host:port" or a Unix socket path), which sends the
+ * same byte stream over the connection; "python perf_timer.py --listen <port>
+ * report.html appname" on the other end receives the capture and renders the usual
+ * report when the recorder disconnects. Because a remote consumer can fall behind,
+ * the flusher's queue is bounded by PERFTIMER_STREAM_QUEUE_LIMIT buffers and drops
+ * (and counts) overflow rather than ever blocking the recording threads.
+ *
+ * On POSIX systems, defining PERFTIMER_OUTPUT_MMAP to true replaces the stdio-based
+ * serializer with one that maps the output file into memory and lays records
+ * directly into the mapping. The file is pre-extended in PERFTIMER_MMAP_CHUNK_SIZE
+ * chunks and trimmed to its real size when the capture ends, and the OS pages
+ * completed regions out asynchronously in the background, so multi-gigabyte
+ * captures no longer double-copy every byte through libc's buffer or stall in
+ * fflush at End(). Combines naturally with PERFTIMER_STREAMING, which moves the
+ * remaining memcpy off the recording threads as well.
+ *
+ * Process trees (a master and its workers) can record one coherent capture. On
+ * POSIX systems, defining PERFTIMER_SHARED_MEMORY to true adds
+ * EventRecorder::StartShared("/segment-name"): the first caller creates a named
+ * shared-memory segment of PERFTIMER_SHM_SIZE bytes and later callers join it,
+ * so the master simply starts before forking. Recording itself is untouched -
+ * events still go to process-local buffers - and at End() each process's Write()
+ * serializes into PERFTIMER_SHM_REGION_SIZE regions carved from the segment with
+ * a single atomic add each, stamped with its pid. The timestamps come from
+ * CLOCK_REALTIME, which all processes on the machine share, so the streams line
+ * up on one timeline, and the pid is folded into the recorded thread ids so two
+ * processes' threads can't alias. When everyone has ended,
+ * EventRecorder::MergeShared("/segment-name", "out.bin") in the coordinating
+ * process splices the regions into an ordinary capture file and removes the
+ * segment. Frame marks stay per-process, so drive frames from one process if the
+ * capture should be frame-based.
+ *
+ * By default the writer emits version 1 of the binary format, which stores the full
+ * name string with every event. Real captures tend to repeat a few hundred distinct
+ * names tens of millions of times, so defining PERFTIMER_FORMAT_VERSION to 2 switches
+ * to a format where each name is written once, the first time it's seen, and events
+ * carry a 4-byte index into that name table instead. perf_timer.py understands both
+ * versions (they're distinguished by the file magic), and v2 captures are typically
+ * an order of magnitude smaller.
+ *
+ * Version 3 goes further: the thread id and an absolute timestamp base are recorded
+ * once per chunk, the frame id once per frame, and each event is then just a tag
+ * byte, a 32-bit nanosecond delta from the chunk base, and a 16-bit name index -
+ * 7 bytes instead of 21-plus. A new chunk record is emitted whenever the recording
+ * thread changes or a delta would overflow 32 bits, so v3 pairs best with
+ * PERFTIMER_THREAD_BUFFERS, where each thread's events are already written out
+ * contiguously. The 16-bit index caps a v3 file at 65536 distinct names; captures
+ * with more (heavy undeduplicated CloneStr use) should stay on v2.
+ *
+ * Captures that leave the machine can additionally be compressed on the fly:
+ * defining PERFTIMER_COMPRESS to true makes the serializer compress each
+ * staging-buffer flush as one LZ4-format block using a small self-contained
+ * encoder (no library dependency). The file then opens with container magic
+ * 0xFA5A followed by the count and the inner format's magic, and each chunk is
+ * framed with a codec id and its raw and stored sizes, so perf_timer.py
+ * decompresses transparently and other codecs can slot in later. The event
+ * stream's repetitive names and near-identical timestamps compress severalfold
+ * even under this greedy encoder, and in streaming builds the compression work
+ * rides on the flusher thread, off the recording threads entirely. Works with
+ * any format version and with streaming, sockets, the flight recorder and
+ * hitch capture; crash dumps stay raw v1 (the signal-safe path cannot stage
+ * blocks), and the mmap writer and shared-memory capture are exclusive with it.
+ *
+ * Every capture file additionally ends with a frame index: a footer listing the
+ * byte range of each frame's events, the timestamp of each frame boundary, and
+ * (v2/v3) the complete name table, closed by a trailer that locates the footer
+ * from the end of the stream in one seek. "python perf_timer.py --frame N
+ * capture.bin ..." uses it to parse just the frame under suspicion instead of
+ * the whole file, which matters when the file is a week-long soak capture. The
+ * footer sits after the last counted event, so readers that trust the header
+ * count never see it and old files without one still work (the viewer falls
+ * back to filtering a full parse). Sockets, crash dumps, the aggregate summary
+ * and shared-memory capture carry no footer.
+ *
+ * On GCC/clang x86 builds, Now() defaults to clock_gettime(CLOCK_REALTIME), which
+ * costs ~25ns per call even through the vDSO and can jump when NTP adjusts the
+ * clock. Defining PERFTIMER_CLOCK_TSC to true makes Now() a single rdtsc instead;
+ * the tick rate is calibrated once against CLOCK_MONOTONIC (using the same lazy
+ * static-init trick as the MSVC performance frequency below), and raw ticks are
+ * converted to nanoseconds when events are serialized rather than on the hot path.
+ * Timestamps are then monotonic for the whole capture. This assumes an invariant
+ * TSC, which every x86 part from the last decade provides.
+ *
+ * For always-on production use, defining PERFTIMER_FLIGHT_RECORDER to true turns
+ * the recorder into a bounded flight recorder: each recording thread gets a fixed
+ * ring of PERFTIMER_FLIGHT_BUFFER_COUNT buffers (allocated up front, so the steady
+ * state never allocates), and once the ring is full the oldest buffer-sized block
+ * of events is overwritten. EventRecorder::Dump(filename) writes whatever the ring
+ * currently holds - i.e. the most recent events - and resets it, so a hitch or
+ * assert handler can salvage the run-up to the problem at any time. Dump() takes
+ * the same locks as Write(), so call it from a point where recording threads can
+ * tolerate a brief stall.
+ *
+ * When the thing being hunted is a hitch - five bad frames somewhere in an hour
+ * of gameplay - recording every frame means gigabytes of data to find them.
+ * Defining PERFTIMER_HITCH_TRIGGER to true makes retention frame-driven instead:
+ * each frame's events are staged in their own buffer chain, and at the next
+ * PERF_FRAME_MARK() the frame is kept only if it ran longer than
+ * PERFTIMER_HITCH_BUDGET_NS (default two 60Hz frames). The
+ * PERFTIMER_HITCH_WINDOW frames preceding a hitch are kept with it, so the
+ * run-up is in the capture too; everything else rotates through that small
+ * window and recycles its buffers, so memory and output scale with the number
+ * of hitches, not the length of the run. Every frame is still measured at its
+ * boundary, so the frame statistics End() prints cover the whole run. The mode
+ * needs PERF_FRAME_MARK() driving frames and the default mutex backend, and is
+ * exclusive with streaming and the flight recorder; crash dumps still salvage
+ * the staged frames around the crash.
+ *
+ * If the process dies, everything the recorder holds normally dies with it - End()
+ * and the destructor never run on SIGSEGV, and Write() leans on stdio and the heap,
+ * neither of which can be touched from a signal handler. Defining
+ * PERFTIMER_CRASH_DUMP to true (POSIX only) adds a salvage path: call
+ * EventRecorder::PrepareCrashDump("crash.bin") from normal code to open the dump
+ * file ahead of time, and have your SIGSEGV/SIGABRT handler call
+ * EventRecorder::CrashDump() before it exits. The dump uses nothing but raw
+ * write(2) on that pre-opened descriptor - no allocation, no stdio, and no locking
+ * against a thread that may have died holding a lock - and patches the header count
+ * from the events it actually managed to write, so the file parses even if another
+ * thread was torn mid-record. Crash dumps are always format version 1.
+ *
+ * Event buffers are pooled across capture sessions: Write() returns each drained
+ * buffer to a free list instead of deleting it, and the next session's buffers come
+ * from that list already allocated and faulted in. Applications that capture in
+ * repeated short bursts (a few seconds on, a minute off) no longer pay an
+ * allocation spike at every Start(). Define PERFTIMER_POOL_BUFFERS to false to
+ * release buffer memory between sessions instead.
+ *
+ * With per-thread buffers the pool is kept per chain rather than recorder-wide:
+ * a buffer is allocated - and its pages first-touched - on the thread that
+ * records into it, and retires back to that same chain, so on NUMA machines each
+ * thread's events stay in its own node's memory instead of bouncing to wherever
+ * some other thread happened to fault the pages. It also removes the last lock
+ * on the recording path: the buffer-full boundary no longer touches the
+ * recorder mutex at all. Separately, events are stored naturally aligned in
+ * memory and only packed down to the wire layout during serialization; define
+ * PERFTIMER_ALIGN_EVENTS to true to additionally pad each in-memory slot to a
+ * cache line (PERFTIMER_CACHE_LINE_SIZE, default 64), which stops adjacent
+ * slots from false-sharing when the lock-free backend has several threads
+ * committing into one buffer, at the cost of proportionally larger buffers.
+ *
+ * Dynamically-built names (CloneStr) are stored in a bump-allocated arena that is
+ * released wholesale at End(), rather than malloc'd per call and freed per event
+ * during Write(). By default repeated identical names are deduplicated and return
+ * the same arena string, which bounds arena growth by the number of distinct names;
+ * define PERFTIMER_NAME_DEDUP to false to skip the lookup if your dynamic names
+ * are almost always unique. Because arena strings stay valid for the whole capture,
+ * CloneStr names are now safe to use with PerfTimer scopes (previously the enter
+ * and exit event shared one malloc'd string and Write() freed it twice).
+ *
+ * Timers can also be tagged with compile-time categories so that one subsystem can
+ * record while the others keep true zero cost. Define each category as a bit:
+ *
+ *     #define MYAPP_CAT_RENDERER (1 << 0)
+ *     #define MYAPP_CAT_PHYSICS  (1 << 1)
+ *
+ * select the enabled set in the build (it defaults to all categories):
+ *
+ *     -DPERFTIMER_ENABLED_CATEGORIES=MYAPP_CAT_PHYSICS
+ *
+ * and tag call sites with PERF_TIMER_CAT(MYAPP_CAT_PHYSICS) or
+ * PERF_NOTE_CAT(category, name). The enabled test is a compile-time
+ * constant, so a disabled category's timer is an empty struct with an empty
+ * constructor - there is nothing left for the optimizer to even remove. Block-scope
+ * categorized timers are available as ::PerfTimer::CategoryPerfTimer<enabled>.
+ *
+ * Numeric metrics (queue depths, memory usage, entity counts) are recorded with
+ * PERF_COUNTER(name, value) rather than formatting the value into a
+ * PERF_NOTE string. A counter costs the same as a scope event - one struct store,
+ * no formatting or allocation - and carries an int64 or double value (the macro
+ * dispatches on the argument type). The viewer graphs each counter per frame
+ * alongside the frame-time graph and summarizes per-thread min/avg/max in the
+ * report pages.
+ *
+ * Ultra-hot scopes - functions called hundreds of thousands of times per second -
+ * can cost more to record than to run. PERF_TIMER_SAMPLED(rate) records only every
+ * Nth invocation per thread: the call site keeps a thread_local tick counter, so a
+ * skipped invocation is an increment, a modulo and a branch, touching no recorder
+ * state at all. The sample rate is written into the output, and the viewer scales
+ * the scope's inclusive/exclusive times and call counts back up by it, so the
+ * aggregate report stays representative (min/max stay per-observation, and a
+ * parent's exclusive time only has the sampled children it actually saw subtracted
+ * from it). Pick a rate that leaves a few thousand samples per capture.
+ *
+ * Frame-based profiling is driven by PERF_FRAME_MARK(): call it once per frame
+ * (top of the main loop) and the recorder stamps every subsequent event with its
+ * internal frame counter - there is no frame id to thread through call sites.
+ * The boundary itself is recorded too, so End() prints frame count and min/avg/max
+ * frame time for the capture, and code that genuinely needs an explicit frame id
+ * (recording on behalf of another frame, say) can still pass one to the
+ * ::PerfTimer::PerfTimer/PerfNote/PerfCounter functions directly. Without any
+ * FrameMark() calls the frame id stays -1, which the viewer treats as "no
+ * frame-based profiling", exactly as before.
+ *
+ * Threads can introduce themselves with PERF_THREAD_NAME("RenderThread"), once
+ * at thread startup. The name goes into a small metadata table rather than onto
+ * every event, each capture file carries the table as THREAD_NAME records, and
+ * the viewer titles that thread's report with the name instead of a raw id. The
+ * table outlives End(), so naming a thread once covers every capture the
+ * process takes; in aggregate builds the name appears in the summary's thread
+ * column instead.
+ *
+ * Work that migrates between threads while a scope is open - a fiber or
+ * coroutine parked on one worker and resumed on another - breaks the RAII
+ * timers, whose call stacks are keyed by thread id. For that,
+ * PERF_TIMER_ASYNC_BEGIN(contextId, name) and PERF_TIMER_ASYNC_END(contextId,
+ * name) record the scope under a caller-supplied context id instead (tagged
+ * with a high bit so it can never alias a real thread id), and the viewer
+ * stitches each context's scopes by that id into its own report stream. Use a
+ * small reused pool of ids - a fiber index, not a task serial number - and
+ * never run one context on two threads at once, which a fiber guarantees by
+ * construction.
+ *
+ * Continuous production monitoring rarely needs every raw event - it needs to
+ * know which blocks ran, how often, and what they cost. Defining
+ * PERFTIMER_AGGREGATE to true folds events into a per-thread tree of call-stack
+ * nodes at record time instead of storing them: an exit adds the scope's
+ * inclusive and exclusive time, call count, and min/max to its node, and Write()
+ * emits a compact tab-separated summary (one line per distinct call stack per
+ * thread, plus per-counter min/avg/max) instead of an event stream. Memory is
+ * bounded by the number of distinct call stacks rather than the number of
+ * events, so a capture can run for a day where buffering every event could not.
+ * It replaces the event buffers entirely - the streaming, flight-recorder,
+ * crash-dump and shared-memory modes don't combine with it - and the summary is
+ * read directly, not through perf_timer.py. Frame marks still feed the frame
+ * count and min/avg/max frame time End() prints.
+ *
  * Additionally, the perf timer *itself* is also disabled by default so that instrumenting
  * your code has zero cost unless you make a build with the perf timer turned on. To turn
  * it on, simply #define PERFTIMER_ENABLED before including the header. (Again, recommended
  * to do this in the makefile.)
  * 
  * Basic usage:
- * 
+ *
+ * void RunFrame()
+ * {
+ *     // Marks the start of a new frame. Everything recorded after this belongs
+ *     // to the new frame until the next mark.
+ *     PERF_FRAME_MARK();
+ *     SomeFunction();
+ * }
+ *
  * void SomeFunction()
  * {
  *     // This creates a performance timer for this function scope. It's automatically named with
  *     // the function's name and results in an object that will go out of scope when the function
  *     // returns.
- *     PERF_TIMER(g_frameCount);
- * 
+ *     PERF_TIMER();
+ *
  *     // This provides a note, which will appear on the output as an annotation on the frame it's
  *     // associated with. This is helpful for tracking the impact on frame time of certain rare events.
- *     PERF_NOTE("A note!", g_frameCount);
- * 
+ *     PERF_NOTE("A note!");
+ *
  *     {
  *         // This creates a block-scope perf timer that will track only the time within
  *         // this specific block of code, and will go out of scope at the closing brace.
- *         ::PerfTimer::PerfTimer blockTimer("Some block", g_frameCount);
+ *         ::PerfTimer::PerfTimer blockTimer("Some block");
  *     }
  * }
  */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <new>
+#include <stdexcept>
 #include <string>
 #include <mutex>
+#include <atomic>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
-#if defined(__GNUC__) || defined(__clang__)
-#	define PERFTIMER_PACK( STRUCT ) STRUCT __attribute__((__packed__))
-#elif defined(_MSC_VER)
-#	define PERFTIMER_PACK( STRUCT ) __pragma( pack(push, 1) ) STRUCT __pragma( pack(pop))
+#if defined(_MSC_VER)
+#	include "Windows.h"
+#	include <malloc.h>
 #endif
 
 #if !defined(PERFTIMER_BUFFER_SIZE)
-#	include "Windows.h"
 #	define PERFTIMER_BUFFER_SIZE 32768
 #endif
 
+// When true, event buffers written out at End() are returned to a pool and
+// reused by the next capture session instead of freed, so repeated short
+// captures draw warm, already-faulted buffers and the first events after
+// Start() don't pay for fresh allocations. Define to false to release buffer
+// memory between sessions.
+#if !defined(PERFTIMER_POOL_BUFFERS)
+#	define PERFTIMER_POOL_BUFFERS true
+#endif
+
+// Cache line size assumed when padding event slots (PERFTIMER_ALIGN_EVENTS).
+#if !defined(PERFTIMER_CACHE_LINE_SIZE)
+#	define PERFTIMER_CACHE_LINE_SIZE 64
+#endif
+
+// When true, each in-memory event slot is padded out to a whole cache line, so
+// no two slots ever share a line. Mostly interesting for the lock-free backend,
+// where adjacent slots in one buffer are claimed by different threads and would
+// otherwise false-share; the other backends fill each buffer from one thread.
+// Costs memory - a slot grows from its natural size to a full line - which is
+// why it is off by default. The on-disk format is unaffected.
+#if !defined(PERFTIMER_ALIGN_EVENTS)
+#	define PERFTIMER_ALIGN_EVENTS false
+#endif
+
+// Size in bytes of each block in the arena backing CloneStr. Names longer than a
+// block get a dedicated oversized block.
+#if !defined(PERFTIMER_NAME_ARENA_BLOCK_SIZE)
+#	define PERFTIMER_NAME_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+// When true, CloneStr returns the same arena string for repeated identical names,
+// bounding arena growth by the number of distinct names.
+#if !defined(PERFTIMER_NAME_DEDUP)
+#	define PERFTIMER_NAME_DEDUP true
+#endif
+
+// Size in bytes of the staging buffer used when serializing events to disk.
+// Serialized records are packed into this buffer and handed to the OS in single
+// large writes rather than paying several libc calls per event.
+#if !defined(PERFTIMER_WRITE_BUFFER_SIZE)
+#	define PERFTIMER_WRITE_BUFFER_SIZE (1024 * 1024)
+#endif
+
+// When true on POSIX systems, the serializer maps the output file into memory
+// and lays records directly into the mapping instead of going through stdio's
+// buffer, letting the OS page completed regions out asynchronously.
+#if !defined(PERFTIMER_OUTPUT_MMAP)
+#	define PERFTIMER_OUTPUT_MMAP false
+#endif
+
+#if PERFTIMER_OUTPUT_MMAP
+#	if defined(_MSC_VER)
+#		error "PERFTIMER_OUTPUT_MMAP is only implemented for POSIX systems"
+#	endif
+#	include <sys/mman.h>
+#	include <unistd.h>
+// A shared writable mapping needs a readable descriptor, which plain "wb" does
+// not provide.
+#	define PERFTIMER_FILE_MODE "wb+"
+#else
+#	define PERFTIMER_FILE_MODE "wb"
+#endif
+
+// Size in bytes by which the output file is pre-extended and remapped when the
+// mmap writer runs out of room. Larger chunks mean fewer remaps.
+#if !defined(PERFTIMER_MMAP_CHUNK_SIZE)
+#	define PERFTIMER_MMAP_CHUNK_SIZE (64 * 1024 * 1024)
+#endif
+
 #if !defined(PERFTIMER_MULTITHREADED)
 #	define PERFTIMER_MULTITHREADED false
 #endif
 
+#if !defined(PERFTIMER_THREAD_BUFFERS)
+#	define PERFTIMER_THREAD_BUFFERS false
+#endif
+
+#if PERFTIMER_THREAD_BUFFERS && !PERFTIMER_MULTITHREADED
+#	error "PERFTIMER_THREAD_BUFFERS requires PERFTIMER_MULTITHREADED"
+#endif
+
+#if !defined(PERFTIMER_BACKEND_LOCKFREE)
+#	define PERFTIMER_BACKEND_LOCKFREE false
+#endif
+
+#if PERFTIMER_BACKEND_LOCKFREE && !PERFTIMER_MULTITHREADED
+#	error "PERFTIMER_BACKEND_LOCKFREE requires PERFTIMER_MULTITHREADED"
+#endif
+
+#if PERFTIMER_BACKEND_LOCKFREE && PERFTIMER_THREAD_BUFFERS
+#	error "PERFTIMER_BACKEND_LOCKFREE and PERFTIMER_THREAD_BUFFERS are alternative backends; enable at most one"
+#endif
+
+#if !defined(PERFTIMER_STREAMING)
+#	define PERFTIMER_STREAMING false
+#endif
+
+#if PERFTIMER_STREAMING && PERFTIMER_BACKEND_LOCKFREE
+#	error "PERFTIMER_STREAMING cannot steal buffers out of the lock-free chain; use the mutex or thread-buffer backend"
+#endif
+
+// When true on POSIX systems, EventRecorder::StartSocket() sends the capture to
+// a live viewer over a TCP or Unix domain socket instead of writing a file. The
+// PERFTIMER_STREAMING flusher is the transport, so that must be enabled too.
+// Run "python perf_timer.py --listen <port> report.html appname" on the
+// receiving end.
+#if !defined(PERFTIMER_SOCKET)
+#	define PERFTIMER_SOCKET false
+#endif
+
+#if PERFTIMER_SOCKET
+#	if defined(_MSC_VER)
+#		error "PERFTIMER_SOCKET is only implemented for POSIX systems"
+#	endif
+#	if !PERFTIMER_STREAMING
+#		error "PERFTIMER_SOCKET sends buffers through the streaming flusher; define PERFTIMER_STREAMING too"
+#	endif
+#	if PERFTIMER_OUTPUT_MMAP
+#		error "PERFTIMER_OUTPUT_MMAP needs a seekable file; it cannot map a socket"
+#	endif
+#	include <sys/socket.h>
+#	include <sys/un.h>
+#	include <netinet/in.h>
+#	include <netdb.h>
+#	include <unistd.h>
+#endif
+
+// Upper bound on the number of filled buffers the streaming flusher may have
+// queued at once. Beyond the limit, freshly filled buffers are dropped (and
+// counted) instead of piling up behind a consumer that can't keep pace; the
+// recording threads never block on the consumer either way. 0 means unbounded,
+// the right choice when the consumer is a local file.
+#if !defined(PERFTIMER_STREAM_QUEUE_LIMIT)
+#	if PERFTIMER_SOCKET
+#		define PERFTIMER_STREAM_QUEUE_LIMIT 16
+#	else
+#		define PERFTIMER_STREAM_QUEUE_LIMIT 0
+#	endif
+#endif
+
+#if !defined(PERFTIMER_FLIGHT_RECORDER)
+#	define PERFTIMER_FLIGHT_RECORDER false
+#endif
+
+#if !defined(PERFTIMER_FLIGHT_BUFFER_COUNT)
+#	define PERFTIMER_FLIGHT_BUFFER_COUNT 8
+#endif
+
+#if PERFTIMER_FLIGHT_RECORDER && PERFTIMER_STREAMING
+#	error "PERFTIMER_FLIGHT_RECORDER keeps only the newest events; combining it with PERFTIMER_STREAMING makes no sense"
+#endif
+
+#if PERFTIMER_FLIGHT_RECORDER && PERFTIMER_BACKEND_LOCKFREE
+#	error "PERFTIMER_FLIGHT_RECORDER is not implemented for the lock-free backend"
+#endif
+
+// When true on POSIX systems, PrepareCrashDump()/CrashDump() provide an
+// async-signal-safe path for a crash handler to salvage recorded events: raw
+// write(2) on a descriptor opened ahead of time, no allocation, no locks.
+#if !defined(PERFTIMER_CRASH_DUMP)
+#	define PERFTIMER_CRASH_DUMP false
+#endif
+
+#if PERFTIMER_CRASH_DUMP
+#	if defined(_MSC_VER)
+#		error "PERFTIMER_CRASH_DUMP is only implemented for POSIX systems"
+#	endif
+#	if PERFTIMER_STREAMING
+#		error "PERFTIMER_CRASH_DUMP is redundant with PERFTIMER_STREAMING, which already has the events on disk"
+#	endif
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <errno.h>
+#endif
+
+// When true on POSIX systems, EventRecorder::StartShared() records into a named
+// shared-memory segment instead of a per-process file, so a process tree (a
+// master and its workers) can produce one coherent capture. Write() carves
+// fixed-size regions out of the segment - one atomic add per region, the only
+// cross-process synchronization anywhere - and stamps each with the writing pid;
+// EventRecorder::MergeShared() combines the regions into an ordinary capture
+// file afterwards. The creating process must call StartShared() before the
+// others attach.
+#if !defined(PERFTIMER_SHARED_MEMORY)
+#	define PERFTIMER_SHARED_MEMORY false
+#endif
+
+#if PERFTIMER_SHARED_MEMORY
+#	if defined(_MSC_VER)
+#		error "PERFTIMER_SHARED_MEMORY is only implemented for POSIX systems"
+#	endif
+#	if PERFTIMER_STREAMING
+#		error "PERFTIMER_SHARED_MEMORY is its own transport; it cannot be combined with PERFTIMER_STREAMING"
+#	endif
+#	if PERFTIMER_FLIGHT_RECORDER
+#		error "PERFTIMER_FLIGHT_RECORDER writes its own dump files; it cannot record into a shared segment"
+#	endif
+#	if PERFTIMER_OUTPUT_MMAP
+#		error "PERFTIMER_OUTPUT_MMAP maps the output file; PERFTIMER_SHARED_MEMORY replaces the file with a segment"
+#	endif
+#	include <sys/mman.h>
+#	include <sys/stat.h>
+#	include <fcntl.h>
+#	include <unistd.h>
+#	include <errno.h>
+#	include <vector>
+#endif
+
+// Size in bytes of the whole shared segment, which must hold every
+// participant's serialized events, and of each region carved from it. Smaller
+// regions waste less tail space per process; larger ones mean fewer carves.
+#if !defined(PERFTIMER_SHM_SIZE)
+#	define PERFTIMER_SHM_SIZE (256 * 1024 * 1024)
+#endif
+
+#if !defined(PERFTIMER_SHM_REGION_SIZE)
+#	define PERFTIMER_SHM_REGION_SIZE (1024 * 1024)
+#endif
+
+// When true, events fold into a per-thread tree of call-stack nodes at record
+// time instead of being appended to event buffers, and Write() emits a compact
+// tab-separated summary (per-stack call counts, inclusive/exclusive time,
+// min/max) rather than an event stream. Memory is proportional to the number
+// of distinct call stacks rather than the number of events, which is what
+// makes day-long monitoring captures feasible.
+#if !defined(PERFTIMER_AGGREGATE)
+#	define PERFTIMER_AGGREGATE false
+#endif
+
+#if PERFTIMER_AGGREGATE
+#	if PERFTIMER_THREAD_BUFFERS || PERFTIMER_BACKEND_LOCKFREE
+#		error "PERFTIMER_AGGREGATE replaces the event buffers entirely; it is its own backend"
+#	endif
+#	if PERFTIMER_STREAMING
+#		error "PERFTIMER_AGGREGATE has no event stream to flush; it writes one summary at End()"
+#	endif
+#	if PERFTIMER_FLIGHT_RECORDER
+#		error "PERFTIMER_FLIGHT_RECORDER keeps raw events; PERFTIMER_AGGREGATE never stores them"
+#	endif
+#	if PERFTIMER_CRASH_DUMP
+#		error "PERFTIMER_CRASH_DUMP salvages buffered events; PERFTIMER_AGGREGATE has none"
+#	endif
+#	if PERFTIMER_SHARED_MEMORY
+#		error "PERFTIMER_SHARED_MEMORY carves event regions; PERFTIMER_AGGREGATE writes summaries - run one per process instead"
+#	endif
+#	if PERFTIMER_OUTPUT_MMAP
+#		error "PERFTIMER_OUTPUT_MMAP serializes an event stream; the aggregate summary is plain text"
+#	endif
+#	include <vector>
+#endif
+
+// When true, the recorder only retains a frame's events if the frame ran
+// longer than PERFTIMER_HITCH_BUDGET_NS, keeping the PERFTIMER_HITCH_WINDOW
+// preceding frames as run-up. Each frame is staged in its own buffer chain and
+// judged at the next PERF_FRAME_MARK(); unhitched frames rotate through a small
+// window and their buffers go back to the pool, so a capture hunting five bad
+// frames in an hour stays five frames big.
+#if !defined(PERFTIMER_HITCH_TRIGGER)
+#	define PERFTIMER_HITCH_TRIGGER false
+#endif
+
+#if PERFTIMER_HITCH_TRIGGER
+#	if PERFTIMER_THREAD_BUFFERS || PERFTIMER_BACKEND_LOCKFREE
+#		error "PERFTIMER_HITCH_TRIGGER judges frames on one ordered stream; it requires the default mutex backend"
+#	endif
+#	if PERFTIMER_STREAMING
+#		error "PERFTIMER_STREAMING writes events out as buffers fill; there is nothing left to discard at a frame boundary"
+#	endif
+#	if PERFTIMER_FLIGHT_RECORDER
+#		error "PERFTIMER_FLIGHT_RECORDER and PERFTIMER_HITCH_TRIGGER are competing retention policies; pick one"
+#	endif
+#	if PERFTIMER_AGGREGATE
+#		error "PERFTIMER_AGGREGATE stores no events for PERFTIMER_HITCH_TRIGGER to retain or discard"
+#	endif
+#endif
+
+// A frame longer than this many nanoseconds is a hitch. The default is two
+// 60 Hz frames - a frame that doubles is worth keeping.
+#if !defined(PERFTIMER_HITCH_BUDGET_NS)
+#	define PERFTIMER_HITCH_BUDGET_NS 33333333
+#endif
+
+// How many frames preceding a hitch are retained along with it.
+#if !defined(PERFTIMER_HITCH_WINDOW)
+#	define PERFTIMER_HITCH_WINDOW 1
+#endif
+
+// When true, the stdio serializer compresses each flushed block before writing
+// it, using a small self-contained encoder that emits the standard LZ4 block
+// format. The event stream is repetitive enough (names, near-identical
+// timestamps) that even this greedy encoder shrinks captures several-fold,
+// which is what matters when they leave the box for a central analysis host.
+// The file opens with a container magic and per-chunk framing that carries a
+// codec id, and perf_timer.py decompresses transparently. Crash dumps stay
+// uncompressed - the signal-safe path cannot stage and compress blocks.
+#if !defined(PERFTIMER_COMPRESS)
+#	define PERFTIMER_COMPRESS false
+#endif
+
+#if PERFTIMER_COMPRESS
+#	if PERFTIMER_OUTPUT_MMAP
+#		error "PERFTIMER_OUTPUT_MMAP lays raw records straight into the page cache; compression needs the stdio serializer"
+#	endif
+#	if PERFTIMER_SHARED_MEMORY
+#		error "MergeShared() splices raw records between processes; compress the merged file instead"
+#	endif
+#	if PERFTIMER_AGGREGATE
+#		error "the aggregate summary is a small text file; there is no event stream to compress"
+#	endif
+#endif
+
+#if !defined(PERFTIMER_CLOCK_TSC)
+#	define PERFTIMER_CLOCK_TSC false
+#endif
+
+#if PERFTIMER_CLOCK_TSC
+#	if defined(_MSC_VER) && !defined(__clang__)
+#		error "PERFTIMER_CLOCK_TSC is only implemented for GCC/clang; MSVC builds already use QueryPerformanceCounter"
+#	elif !defined(__x86_64__) && !defined(__i386__)
+#		error "PERFTIMER_CLOCK_TSC requires an x86 target"
+#	endif
+#	include <x86intrin.h>
+#	include <time.h>
+#endif
+
+#if !defined(PERFTIMER_FORMAT_VERSION)
+#	define PERFTIMER_FORMAT_VERSION 1
+#endif
+
+#if PERFTIMER_FORMAT_VERSION < 1 || PERFTIMER_FORMAT_VERSION > 3
+#	error "PERFTIMER_FORMAT_VERSION must be 1, 2, or 3"
+#endif
+
+// Each format version has its own magic so the viewer can tell them apart.
+#if PERFTIMER_FORMAT_VERSION >= 3
+#	define PERFTIMER_FILE_MAGIC 0xFA59
+#elif PERFTIMER_FORMAT_VERSION >= 2
+#	define PERFTIMER_FILE_MAGIC 0xFA58
+#else
+#	define PERFTIMER_FILE_MAGIC 0xFA57
+#endif
+
+#if PERFTIMER_SHARED_MEMORY
+#	if PERFTIMER_FORMAT_VERSION != 1
+#		error "PERFTIMER_SHARED_MEMORY writes names by value so the merge can splice process streams; it requires format version 1"
+#	endif
+// The segment carries its own magic: it is a staging area, not a capture file,
+// and must not be mistaken for one.
+#	define PERFTIMER_SHM_MAGIC 0xFA5C
+#endif
+
+// Compressed captures open with the container magic; the inner format's magic
+// follows the count, so one container wraps any format version.
+#if PERFTIMER_COMPRESS
+#	define PERFTIMER_COMPRESS_MAGIC 0xFA5A
+#endif
+
+// The frame index footer appended after the last event opens and closes with
+// its own magic, so a reader that finds it at the end of the stream can trust
+// the offsets inside. Readers that read exactly 'count' events never see it.
+#define PERFTIMER_INDEX_MAGIC 0xFA5B
+
+// Bit mask of the categories that should record. Categories are application-defined
+// bits; the default enables all of them. The test against this mask happens at
+// compile time, so PERF_TIMER_CAT in a disabled category costs nothing at all.
+#if !defined(PERFTIMER_ENABLED_CATEGORIES)
+#	define PERFTIMER_ENABLED_CATEGORIES 0xFFFFFFFF
+#endif
+
 #if defined PERFTIMER_ENABLED
 #	if defined(_MSC_VER) && !defined(__clang__)
-#		define PERF_TIMER(frameId) ::PerfTimer::PerfTimer funcTimer__(__FUNCTION__, (frameId))
+#		define PERF_TIMER() ::PerfTimer::PerfTimer funcTimer__(__FUNCTION__)
+#		define PERF_TIMER_CAT(category) ::PerfTimer::CategoryPerfTimer<((category) & (PERFTIMER_ENABLED_CATEGORIES)) != 0> funcTimer__(__FUNCTION__)
+#		define PERF_TIMER_SAMPLED(rate) static thread_local uint32_t perfSampleTick__ = 0; ::PerfTimer::SampledPerfTimer funcTimer__(__FUNCTION__, perfSampleTick__++, (rate))
+#	else
+#		define PERF_TIMER() ::PerfTimer::PerfTimer funcTimer__(__PRETTY_FUNCTION__)
+#		define PERF_TIMER_CAT(category) ::PerfTimer::CategoryPerfTimer<((category) & (PERFTIMER_ENABLED_CATEGORIES)) != 0> funcTimer__(__PRETTY_FUNCTION__)
+#		define PERF_TIMER_SAMPLED(rate) static thread_local uint32_t perfSampleTick__ = 0; ::PerfTimer::SampledPerfTimer funcTimer__(__PRETTY_FUNCTION__, perfSampleTick__++, (rate))
+#	endif
+#	define PERF_NOTE(name) ::PerfTimer::PerfNote((name))
+#	define PERF_NOTE_CAT(category, name) ::PerfTimer::PerfNoteCat<((category) & (PERFTIMER_ENABLED_CATEGORIES)) != 0>((name))
+#	define PERF_COUNTER(name, value) ::PerfTimer::PerfCounter((name), (value))
+#	define PERF_FRAME_MARK() ::PerfTimer::EventRecorder::FrameMark()
+#	define PERF_THREAD_NAME(name) ::PerfTimer::EventRecorder::SetThreadName((name))
+#	define PERF_TIMER_ASYNC_BEGIN(contextId, name) ::PerfTimer::PerfAsyncBegin((contextId), (name))
+#	define PERF_TIMER_ASYNC_END(contextId, name) ::PerfTimer::PerfAsyncEnd((contextId), (name))
+#else
+#	define PERF_TIMER()
+#	define PERF_TIMER_CAT(category)
+#	define PERF_TIMER_SAMPLED(rate)
+#	define PERF_NOTE(name)
+#	define PERF_NOTE_CAT(category, name)
+#	define PERF_COUNTER(name, value)
+#	define PERF_FRAME_MARK()
+#	define PERF_THREAD_NAME(name)
+#	define PERF_TIMER_ASYNC_BEGIN(contextId, name)
+#	define PERF_TIMER_ASYNC_END(contextId, name)
+#endif
+
+namespace PerfTimer
+{
+	enum class EventType : unsigned char
+	{
+		ENTER_CONTEXT = 0,
+		EXIT_CONTEXT = 1,
+		NOTE = 2,
+		COUNTER = 3,
+		COUNTER_FLOAT = 4,
+		FRAME_BOUNDARY = 5,
+		SAMPLED_ENTER = 6,
+		// Metadata, not a profile sample: names a thread for the viewer. Written
+		// once per registered thread from SetThreadName()'s table, not per event.
+		THREAD_NAME = 7
+	};
+
+	// Default for the frameCount parameters below: "stamp with the recorder's
+	// frame counter", which PERF_FRAME_MARK() advances. Resolved when the event
+	// is recorded, so the sentinel never reaches the file.
+	constexpr int32_t FRAME_AUTO = INT32_MIN;
+
+	// Scopes recorded on behalf of a migrating fiber or coroutine carry a
+	// caller-supplied context id in place of the worker thread's id, with this
+	// bit set so the two can never alias (pthread_self values are addresses and
+	// Windows thread ids are small integers; neither reaches bit 62). The viewer
+	// stitches each context's scopes by that id and reports them as their own
+	// "Async Context" stream. See PerfAsyncBegin/PerfAsyncEnd below.
+	constexpr int64_t ASYNC_CONTEXT_BIT = int64_t(1) << 62;
+
+	inline int64_t Now();
+
+	// In memory the event is naturally aligned - the packed wire layout exists
+	// only on disk and is assembled during serialization (see PackEventPrefix) -
+	// so the hot-path stores never straddle a cache line the way a packed
+	// struct's members do.
+#if PERFTIMER_ALIGN_EVENTS
+	struct alignas(PERFTIMER_CACHE_LINE_SIZE) ProfileEvent
+#else
+	struct ProfileEvent
+#endif
+	{
+		EventType eventType;
+		int64_t threadId;
+		int32_t frameCount;
+		int64_t timestamp;
+		char const* name{ nullptr };
+		// Counter payload; COUNTER_FLOAT stores the bit pattern of a double,
+		// and SAMPLED_ENTER stores the call site's sample rate. Zero (and
+		// unserialized) for every other event type.
+		int64_t value{ 0 };
+	};
+
+	struct ProfileEventBuffer
+	{
+		ProfileEvent events[PERFTIMER_BUFFER_SIZE]{};
+		ProfileEvent* current{ events };
+		ProfileEventBuffer* next{ nullptr };
+	};
+
+	// alignas past alignof(max_align_t) is only honored by operator new from
+	// C++17's aligned-allocation support; under C++14 a plain new returns
+	// malloc-aligned memory, which quietly loses the cache-line placement that
+	// PERFTIMER_ALIGN_EVENTS exists to provide (and GCC warns: -Waligned-new).
+	// All event buffer allocation therefore goes through these helpers, which
+	// take an explicitly aligned path on pre-C++17 compilers.
+	template <typename Buffer>
+	inline Buffer* NewEventBuffer()
+	{
+#if !PERFTIMER_ALIGN_EVENTS || defined(__cpp_aligned_new)
+		return new Buffer();
+#elif defined(_MSC_VER)
+		void* memory = _aligned_malloc(sizeof(Buffer), PERFTIMER_CACHE_LINE_SIZE);
+		if (memory == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+		return new (memory) Buffer();
+#else
+		void* memory = nullptr;
+		if (posix_memalign(&memory, PERFTIMER_CACHE_LINE_SIZE, sizeof(Buffer)) != 0)
+		{
+			throw std::bad_alloc();
+		}
+		return new (memory) Buffer();
+#endif
+	}
+
+	template <typename Buffer>
+	inline void DeleteEventBuffer(Buffer* buffer)
+	{
+#if !PERFTIMER_ALIGN_EVENTS || defined(__cpp_aligned_new)
+		delete buffer;
+#else
+		if (buffer != nullptr)
+		{
+			buffer->~Buffer();
+#	if defined(_MSC_VER)
+			_aligned_free(buffer);
 #	else
-#		define PERF_TIMER(frameId) ::PerfTimer::PerfTimer funcTimer__(__PRETTY_FUNCTION__, (frameId))
+			free(buffer);
 #	endif
-#	define PERF_NOTE(name, frameId) ::PerfTimer::PerfNote((name), (frameId))
+		}
+#endif
+	}
+
+#if PERFTIMER_FLIGHT_RECORDER
+	// Pre-allocates a fixed circular chain of buffers; the recorder walks it forever,
+	// overwriting the oldest buffer-sized block of events each time it comes around.
+	inline ProfileEventBuffer* AllocateFlightRing()
+	{
+		ProfileEventBuffer* first = NewEventBuffer<ProfileEventBuffer>();
+		ProfileEventBuffer* last = first;
+		for (int i = 1; i < PERFTIMER_FLIGHT_BUFFER_COUNT; ++i)
+		{
+			last->next = NewEventBuffer<ProfileEventBuffer>();
+			last = last->next;
+		}
+		last->next = first;
+		return first;
+	}
+#endif
+
+#if PERFTIMER_THREAD_BUFFERS
+	// One of these exists for each thread that has recorded at least one event. Each
+	// thread appends to its own buffer chain; the chains themselves are linked together
+	// so that Write() can walk all of them.
+	struct ThreadEventChain
+	{
+		ProfileEventBuffer* first{ nullptr };
+		ProfileEventBuffer* current{ nullptr };
+		int count{ 0 };
+#if PERFTIMER_FLIGHT_RECORDER
+		bool wrapped{ false };
+#elif !PERFTIMER_STREAMING
+		// Retired buffers are pooled per chain rather than recorder-wide, so a
+		// buffer only ever refills on the thread that first touched its pages -
+		// on NUMA machines that keeps each thread's events in node-local memory.
+		// (Streaming still pools recorder-wide: there the flusher hands buffers
+		// back while recording threads draw fresh ones, so the pool needs a lock
+		// anyway.)
+		ProfileEventBuffer* pool{ nullptr };
+#endif
+		ThreadEventChain* nextChain{ nullptr };
+	};
+#endif
+
+#if PERFTIMER_BACKEND_LOCKFREE
+	// A buffer in the lock-free chain. Producers reserve a slot by incrementing
+	// 'claimed' and bump 'committed' once the slot contents are fully written, so
+	// Write() can tell how many slots actually hold events. 'claimed' may run past
+	// the buffer size under contention; every claim at or beyond the end loses and
+	// moves on to the next buffer in the chain.
+	struct LockFreeEventBuffer
+	{
+		ProfileEvent events[PERFTIMER_BUFFER_SIZE]{};
+		std::atomic<int> claimed{ 0 };
+		std::atomic<int> committed{ 0 };
+		std::atomic<LockFreeEventBuffer*> next{ nullptr };
+	};
+#endif
+
+#if PERFTIMER_HITCH_TRIGGER
+	// A closed frame's staged buffers, parked while the recorder decides whether
+	// a nearby frame hitches. 'last' is the chain's tail so retention can splice
+	// the whole chain onto the retained events in O(1).
+	struct HitchFrame
+	{
+		ProfileEventBuffer* first{ nullptr };
+		ProfileEventBuffer* last{ nullptr };
+		int count{ 0 };
+	};
+#endif
+
+#if !PERFTIMER_AGGREGATE && !PERFTIMER_SHARED_MEMORY
+	// One contiguous run of same-frame records in the serialized stream. A frame
+	// usually maps to one range, but per-thread chains are written one thread at
+	// a time, so a frame's events can form several runs scattered through the
+	// file; the index footer lists them all.
+	struct FrameIndexRange
+	{
+		int32_t frameId;
+		int64_t offset;
+		int32_t eventCount;
+	};
+
+	// A FRAME_BOUNDARY as it passed the serializer; consecutive boundary
+	// timestamps give each frame's wall time without reading any events.
+	struct FrameIndexBoundary
+	{
+		int32_t frameId;
+		int64_t timestamp;
+	};
+#endif
+
+#if PERFTIMER_AGGREGATE
+	// A node in a thread's tree of distinct call stacks. Children are keyed by
+	// name pointer: static names are string literals and dynamic names are
+	// deduplicated by the arena, so equal names share an address. (With
+	// PERFTIMER_NAME_DEDUP off, repeated dynamic names land in separate rows
+	// with the same text - harmless, just less compact.)
+	struct AggregateNode
+	{
+		char const* name{ nullptr };
+		std::unordered_map<char const*, AggregateNode*> children;
+		int64_t count{ 0 };
+		int64_t inclusive{ 0 };
+		int64_t exclusive{ 0 };
+		int64_t minInclusive{ INT64_MAX };
+		int64_t maxInclusive{ 0 };
+
+		~AggregateNode()
+		{
+			for (auto& child : children)
+			{
+				delete child.second;
+			}
+		}
+	};
+
+	// A scope that has been entered but not yet exited. 'childTime' accumulates
+	// the inclusive time of completed children so the exit can compute exclusive
+	// time; 'weight' is 1, or the sample rate for a sampled scope.
+	struct AggregateOpenScope
+	{
+		AggregateNode* node;
+		int64_t enterTimestamp;
+		int64_t childTime;
+		int64_t weight;
+	};
+
+	// Running summary of one counter name on one thread.
+	struct AggregateCounter
+	{
+		int64_t count{ 0 };
+		double minValue{ 0 };
+		double maxValue{ 0 };
+		double totalValue{ 0 };
+	};
+
+	// One of these exists for each thread that has recorded at least one event.
+	// Each thread folds events into its own tree; the states themselves are
+	// linked together so that Write() can walk all of them.
+	struct AggregateThreadState
+	{
+		int64_t threadId{ 0 };
+		AggregateNode root;
+		std::vector<AggregateOpenScope> stack;
+		std::unordered_map<char const*, AggregateCounter> counters;
+		int64_t eventCount{ 0 };
+		AggregateThreadState* nextState{ nullptr };
+	};
+#endif
+
+	// Bump allocator backing CloneStr. Dynamic names live here for the whole capture
+	// and the arena is released in one sweep at End(), so recording never pays a
+	// malloc on the hot path and Write() no longer frees names event by event.
+	// Intentionally leaks at process exit to stay independent of static destruction
+	// order relative to the EventRecorder.
+	class NameArena
+	{
+	public:
+		static NameArena& get()
+		{
+			static NameArena arena;
+			return arena;
+		}
+
+		char const* Clone(char const* str)
+		{
+			size_t size = strlen(str);
+#if PERFTIMER_MULTITHREADED
+			std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+#if PERFTIMER_NAME_DEDUP
+			auto found = m_names.find(str);
+			if (found != m_names.end())
+			{
+				// Stored pointers skip the marker byte; back up to return the full string.
+				return *found - 1;
+			}
+#endif
+			if (m_remaining < size + 2)
+			{
+				size_t capacity = PERFTIMER_NAME_ARENA_BLOCK_SIZE;
+				if (capacity < size + 2)
+				{
+					capacity = size + 2;
+				}
+				Block* block = reinterpret_cast<Block*>(malloc(sizeof(Block) + capacity));
+				if (block == nullptr)
+				{
+					throw std::runtime_error("Out of memory");
+				}
+				block->next = m_blocks;
+				m_blocks = block;
+				m_cursor = reinterpret_cast<char*>(block + 1);
+				m_remaining = capacity;
+			}
+			char* ret = m_cursor;
+			m_cursor += size + 2;
+			m_remaining -= size + 2;
+			ret[0] = '\1';
+			memcpy(ret + 1, str, size);
+			ret[size + 1] = '\0';
+#if PERFTIMER_NAME_DEDUP
+			m_names.insert(ret + 1);
+#endif
+			return ret;
+		}
+
+		void Release()
+		{
+#if PERFTIMER_MULTITHREADED
+			std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+			while (m_blocks != nullptr)
+			{
+				Block* next = m_blocks->next;
+				free(m_blocks);
+				m_blocks = next;
+			}
+			m_cursor = nullptr;
+			m_remaining = 0;
+#if PERFTIMER_NAME_DEDUP
+			m_names.clear();
+#endif
+		}
+
+	private:
+		struct Block
+		{
+			Block* next;
+		};
+
+#if PERFTIMER_NAME_DEDUP
+		struct StrHash
+		{
+			size_t operator()(char const* str) const
+			{
+				// FNV-1a
+				size_t hash = 14695981039346656037ull;
+				while (*str != '\0')
+				{
+					hash ^= static_cast<unsigned char>(*str);
+					hash *= 1099511628211ull;
+					++str;
+				}
+				return hash;
+			}
+		};
+
+		struct StrEqual
+		{
+			bool operator()(char const* left, char const* right) const
+			{
+				return strcmp(left, right) == 0;
+			}
+		};
+
+		std::unordered_set<char const*, StrHash, StrEqual> m_names;
+#endif
+#if PERFTIMER_MULTITHREADED
+		std::mutex m_mutex;
+#endif
+		Block* m_blocks{ nullptr };
+		char* m_cursor{ nullptr };
+		size_t m_remaining{ 0 };
+	};
+
+	inline char const* CloneStr(char const* str)
+	{
+		return NameArena::get().Clone(str);
+	}
+
+#if PERFTIMER_CLOCK_TSC
+	namespace internal_
+	{
+		struct TscCalibrationData
+		{
+			int64_t tscBase;
+			int64_t nsBase;
+			double nsPerTick;
+		};
+
+		inline int64_t ClockNanoseconds(clockid_t clock)
+		{
+			struct timespec ts;
+			clock_gettime(clock, &ts);
+			int64_t nanosecondResult = ts.tv_sec;
+			nanosecondResult *= 1000000000;
+			nanosecondResult += ts.tv_nsec;
+			return nanosecondResult;
+		}
+
+		// Measures the TSC rate against CLOCK_MONOTONIC over a short busy-wait window.
+		// The wall-clock base is taken from CLOCK_REALTIME so converted timestamps stay
+		// on the same scale the other clock sources produce.
+		inline TscCalibrationData CalibrateTsc()
+		{
+			TscCalibrationData data;
+			data.nsBase = ClockNanoseconds(CLOCK_REALTIME);
+			int64_t monotonicStart = ClockNanoseconds(CLOCK_MONOTONIC);
+			data.tscBase = static_cast<int64_t>(__rdtsc());
+			int64_t monotonicEnd;
+			do
+			{
+				monotonicEnd = ClockNanoseconds(CLOCK_MONOTONIC);
+			} while (monotonicEnd - monotonicStart < 10 * 1000 * 1000);
+			int64_t tscEnd = static_cast<int64_t>(__rdtsc());
+			data.nsPerTick = double(monotonicEnd - monotonicStart) / double(tscEnd - data.tscBase);
+			return data;
+		}
+
+		template<bool allowInHeader = true>
+		struct TscCalibration
+		{
+			static TscCalibrationData value;
+		};
+
+		template<bool allowInHeader>
+		/*static*/ TscCalibrationData TscCalibration<allowInHeader>::value = CalibrateTsc();
+
+		inline int64_t TscToNanoseconds(int64_t tsc)
+		{
+			TscCalibrationData const& calibration = TscCalibration<>::value;
+			return calibration.nsBase + int64_t(double(tsc - calibration.tscBase) * calibration.nsPerTick);
+		}
+	}
+#endif
+
+#if PERFTIMER_SHARED_MEMORY
+	// Layout of the named segment: a header with an atomic allocation cursor,
+	// followed by the regions it hands out. Regions are fixed size; 'used' is
+	// published when a region fills (or at the end of the owner's Write()), so
+	// the merge only ever reads completed bytes.
+	struct SharedSegmentHeader
+	{
+		int32_t magic;
+		std::atomic<uint64_t> cursor;
+	};
+
+	struct SharedRegionHeader
+	{
+		int32_t pid;
+		uint32_t used;
+	};
+#endif
+
+#if PERFTIMER_COMPRESS
+	namespace internal_
+	{
+		// Worst case for an LZ4 block: incompressible input costs one run byte per
+		// 255 literals on top of the data itself.
+		inline size_t CompressBound(size_t size)
+		{
+			return size + size / 255 + 16;
+		}
+
+		// Greedy single-pass encoder emitting the standard LZ4 block format
+		// (token, literal run, 2-byte offset, match run), so chunks tagged with
+		// this codec can also be decoded by any stock LZ4 library. A 4-byte hash
+		// keeps the most recent candidate position; matches shorter than 4 bytes
+		// or farther back than 65535 bytes are not representable and stay
+		// literals. Returns the compressed size, which the caller compares
+		// against the input size to store incompressible blocks raw instead.
+		inline size_t CompressBlock(unsigned char const* src, size_t size, unsigned char* dst)
+		{
+			int32_t table[4096];
+			for (int i = 0; i < 4096; ++i)
+			{
+				table[i] = -1;
+			}
+			size_t out = 0;
+			size_t anchor = 0;
+			auto emitLength = [&](size_t length)
+			{
+				while (length >= 255)
+				{
+					dst[out] = 255;
+					++out;
+					length -= 255;
+				}
+				dst[out] = static_cast<unsigned char>(length);
+				++out;
+			};
+			auto emitSequence = [&](size_t literalEnd, size_t matchLength, size_t offset)
+			{
+				const size_t literals = literalEnd - anchor;
+				const size_t tokenAt = out;
+				++out;
+				unsigned char token = literals >= 15 ? 15 << 4 : static_cast<unsigned char>(literals << 4);
+				if (literals >= 15)
+				{
+					emitLength(literals - 15);
+				}
+				memcpy(dst + out, src + anchor, literals);
+				out += literals;
+				if (matchLength != 0)
+				{
+					dst[out] = static_cast<unsigned char>(offset & 0xFF);
+					dst[out + 1] = static_cast<unsigned char>(offset >> 8);
+					out += 2;
+					const size_t code = matchLength - 4;
+					if (code >= 15)
+					{
+						token |= 15;
+						emitLength(code - 15);
+					}
+					else
+					{
+						token |= static_cast<unsigned char>(code);
+					}
+				}
+				dst[tokenAt] = token;
+			};
+			// The format requires the last match to start at least 12 bytes before
+			// the end of the block and stop 5 before it; short inputs are emitted
+			// as one literal run.
+			const size_t matchStartLimit = size > 12 ? size - 12 : 0;
+			size_t in = 0;
+			while (in < matchStartLimit)
+			{
+				uint32_t sequence;
+				memcpy(&sequence, src + in, sizeof(sequence));
+				const uint32_t hash = (sequence * 2654435761u) >> 20;
+				const int32_t candidate = table[hash];
+				table[hash] = static_cast<int32_t>(in);
+				if (candidate >= 0 && in - candidate <= 65535)
+				{
+					uint32_t candidateSequence;
+					memcpy(&candidateSequence, src + candidate, sizeof(candidateSequence));
+					if (candidateSequence == sequence)
+					{
+						size_t matchLength = 4;
+						const size_t matchEndLimit = size - 5;
+						while (in + matchLength < matchEndLimit
+							&& src[candidate + matchLength] == src[in + matchLength])
+						{
+							++matchLength;
+						}
+						emitSequence(in, matchLength, in - candidate);
+						in += matchLength;
+						anchor = in;
+						continue;
+					}
+				}
+				++in;
+			}
+			emitSequence(size, 0, 0);
+			return out;
+		}
+	}
+#endif
+
+	// Packs serialized records into a staging buffer and flushes it with single
+	// large fwrite calls. The Write() loops otherwise issue two or three libc calls
+	// per event, which dominates the cost of writing large captures.
+#if PERFTIMER_OUTPUT_MMAP
+	// Serializer that lays records directly into a memory mapping of the output
+	// file instead of double-copying every byte through stdio's buffer. The file
+	// is pre-extended in PERFTIMER_MMAP_CHUNK_SIZE chunks so writes never block
+	// on growth, and the destructor trims it back to the bytes actually written.
+	// It holds a dup of the descriptor because callers fclose the stream before
+	// the serializer goes out of scope.
+	class EventSerializer
+	{
+	public:
+		explicit EventSerializer(FILE* output)
+		{
+			// The magic and count are written through stdio before the serializer
+			// takes over; flush them so the mapping sees a consistent file.
+			fflush(output);
+			m_start = static_cast<size_t>(ftell(output));
+			m_fd = dup(fileno(output));
+			Remap(PERFTIMER_MMAP_CHUNK_SIZE);
+		}
+
+		~EventSerializer()
+		{
+			if (m_map != nullptr)
+			{
+				munmap(m_map, m_mappedSize);
+			}
+			// Drop the unused tail of the last pre-extension.
+			if (ftruncate(m_fd, static_cast<off_t>(m_start + m_written)) != 0)
+			{
+				perror("Could not trim perf_timer output file.");
+			}
+			close(m_fd);
+		}
+
+		void WriteBytes(void const* data, size_t size)
+		{
+			if (m_start + m_written + size > m_mappedSize)
+			{
+				size_t newSize = m_mappedSize + PERFTIMER_MMAP_CHUNK_SIZE;
+				while (m_start + m_written + size > newSize)
+				{
+					newSize += PERFTIMER_MMAP_CHUNK_SIZE;
+				}
+				Remap(newSize);
+			}
+			memcpy(m_map + m_start + m_written, data, size);
+			m_written += size;
+		}
+
+		void Flush()
+		{
+			// Nothing to do - the OS writes dirty pages back on its own schedule.
+		}
+
+		// Bytes of serialized records written so far. The frame index records
+		// stream offsets relative to the serializer's first byte, so they hold
+		// in plain, mmap'd and compressed output alike.
+		int64_t BytesWritten() const
+		{
+			return static_cast<int64_t>(m_written);
+		}
+
+	private:
+		void Remap(size_t size)
+		{
+			if (m_map != nullptr)
+			{
+				munmap(m_map, m_mappedSize);
+				m_map = nullptr;
+			}
+			if (ftruncate(m_fd, static_cast<off_t>(size)) != 0)
+			{
+				throw std::runtime_error("Could not extend perf_timer output file");
+			}
+			void* map = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+			if (map == MAP_FAILED)
+			{
+				throw std::runtime_error("Could not map perf_timer output file");
+			}
+			m_map = static_cast<char*>(map);
+			m_mappedSize = size;
+		}
+
+		int m_fd{ -1 };
+		char* m_map{ nullptr };
+		size_t m_mappedSize{ 0 };
+		size_t m_start{ 0 };
+		size_t m_written{ 0 };
+	};
+#elif PERFTIMER_SHARED_MEMORY
+	// Serializer that lays records into fixed-size regions carved from the shared
+	// segment. Records may split across a process's consecutive regions; the merge
+	// splices each process's regions back together in carve order, so the spliced
+	// stream reads exactly like a single-process capture.
+	class EventSerializer
+	{
+	public:
+		EventSerializer(char* segment, int32_t pid)
+			: m_segment(segment)
+			, m_pid(pid)
+		{
+		}
+
+		// No flushing destructor: Write() unmaps the segment right after the
+		// explicit Flush(), so a late flush would touch unmapped memory.
+
+		void WriteBytes(void const* data, size_t size)
+		{
+			char const* bytes = static_cast<char const*>(data);
+			while (size > 0)
+			{
+				if (m_region == nullptr || m_used == PERFTIMER_SHM_REGION_SIZE)
+				{
+					if (!CarveRegion())
+					{
+						return;
+					}
+				}
+				size_t chunk = size;
+				if (chunk > PERFTIMER_SHM_REGION_SIZE - m_used)
+				{
+					chunk = PERFTIMER_SHM_REGION_SIZE - m_used;
+				}
+				memcpy(m_region + sizeof(SharedRegionHeader) + m_used, bytes, chunk);
+				m_used += chunk;
+				bytes += chunk;
+				size -= chunk;
+			}
+		}
+
+		void Flush()
+		{
+			// Publish the final region's fill; full regions were published as the
+			// next one was carved.
+			if (m_region != nullptr)
+			{
+				// GCC 12's -Wdangling-pointer decides the stack serializer in
+				// Write() may be dead by the time this store (inlined there)
+				// runs; it is not - Write() flushes strictly before the segment
+				// is unmapped and the serializer leaves scope. Suppress just
+				// this store.
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+				reinterpret_cast<SharedRegionHeader*>(m_region)->used = static_cast<uint32_t>(m_used);
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#	pragma GCC diagnostic pop
+#endif
+			}
+		}
+
+	private:
+		bool CarveRegion()
+		{
+			if (m_region != nullptr)
+			{
+				reinterpret_cast<SharedRegionHeader*>(m_region)->used = static_cast<uint32_t>(m_used);
+				m_region = nullptr;
+			}
+			if (m_full)
+			{
+				return false;
+			}
+			SharedSegmentHeader* header = reinterpret_cast<SharedSegmentHeader*>(m_segment);
+			const uint64_t stride = sizeof(SharedRegionHeader) + PERFTIMER_SHM_REGION_SIZE;
+			const uint64_t offset = header->cursor.fetch_add(stride);
+			if (offset + stride > PERFTIMER_SHM_SIZE)
+			{
+				fprintf(stderr, "perf_timer: shared segment is full; remaining events from pid %d are dropped.\n", static_cast<int>(m_pid));
+				m_full = true;
+				return false;
+			}
+			m_region = m_segment + offset;
+			SharedRegionHeader* regionHeader = reinterpret_cast<SharedRegionHeader*>(m_region);
+			regionHeader->pid = m_pid;
+			regionHeader->used = 0;
+			m_used = 0;
+			return true;
+		}
+
+		char* m_segment;
+		char* m_region{ nullptr };
+		size_t m_used{ 0 };
+		int32_t m_pid;
+		bool m_full{ false };
+	};
+#else
+	class EventSerializer
+	{
+	public:
+		explicit EventSerializer(FILE* output)
+			: m_output(output)
+			, m_buffer(new char[PERFTIMER_WRITE_BUFFER_SIZE])
+		{
+#if PERFTIMER_COMPRESS
+			m_compressed = new unsigned char[internal_::CompressBound(PERFTIMER_WRITE_BUFFER_SIZE)];
+#endif
+		}
+
+		~EventSerializer()
+		{
+			Flush();
+			delete[] m_buffer;
+#if PERFTIMER_COMPRESS
+			delete[] m_compressed;
+#endif
+		}
+
+		void WriteBytes(void const* data, size_t size)
+		{
+			m_written += size;
+#if PERFTIMER_COMPRESS
+			// Every byte goes through the staging buffer so each flushed chunk
+			// compresses as one block - including writes larger than the buffer,
+			// which the uncompressed path below hands straight to fwrite.
+			char const* bytes = static_cast<char const*>(data);
+			while (size > 0)
+			{
+				size_t chunk = PERFTIMER_WRITE_BUFFER_SIZE - m_used;
+				if (chunk > size)
+				{
+					chunk = size;
+				}
+				memcpy(m_buffer + m_used, bytes, chunk);
+				m_used += chunk;
+				bytes += chunk;
+				size -= chunk;
+				if (m_used == PERFTIMER_WRITE_BUFFER_SIZE)
+				{
+					Flush();
+				}
+			}
+#else
+			if (m_used + size > PERFTIMER_WRITE_BUFFER_SIZE)
+			{
+				Flush();
+				if (size > PERFTIMER_WRITE_BUFFER_SIZE)
+				{
+					fwrite(data, size, 1, m_output);
+					return;
+				}
+			}
+			memcpy(m_buffer + m_used, data, size);
+			m_used += size;
+#endif
+		}
+
+		void Flush()
+		{
+			if (m_used != 0)
+			{
+#if PERFTIMER_COMPRESS
+				// Chunk framing: codec byte, raw size, stored size, payload. Codec 1
+				// is an LZ4 block; a block the encoder cannot shrink is stored raw
+				// as codec 0 rather than grown.
+				const size_t compressedSize = internal_::CompressBlock(
+					reinterpret_cast<unsigned char const*>(m_buffer), m_used, m_compressed);
+				unsigned char codec = 1;
+				void const* payload = m_compressed;
+				uint32_t storedSize = static_cast<uint32_t>(compressedSize);
+				if (compressedSize >= m_used)
+				{
+					codec = 0;
+					payload = m_buffer;
+					storedSize = static_cast<uint32_t>(m_used);
+				}
+				const uint32_t rawSize = static_cast<uint32_t>(m_used);
+				fwrite(&codec, sizeof(codec), 1, m_output);
+				fwrite(&rawSize, sizeof(rawSize), 1, m_output);
+				fwrite(&storedSize, sizeof(storedSize), 1, m_output);
+				fwrite(payload, storedSize, 1, m_output);
+#else
+				fwrite(m_buffer, m_used, 1, m_output);
+#endif
+				m_used = 0;
+			}
+		}
+
+		// Bytes of serialized records written so far. The frame index records
+		// stream offsets relative to the serializer's first byte; for compressed
+		// output that is an offset into the decompressed stream, which is what
+		// the viewer navigates anyway.
+		int64_t BytesWritten() const
+		{
+			return static_cast<int64_t>(m_written);
+		}
+
+	private:
+		FILE* m_output;
+		char* m_buffer;
+		size_t m_used{ 0 };
+		size_t m_written{ 0 };
+#if PERFTIMER_COMPRESS
+		unsigned char* m_compressed{ nullptr };
+#endif
+	};
+#endif
+
+	class EventRecorder
+	{
+	public:
+		~EventRecorder()
+		{
+			Write();
+		}
+
+		void AddEvent(ProfileEvent&& event)
+		{
+			if (!m_enabled)
+			{
+				return;
+			}
+#if PERFTIMER_AGGREGATE
+			AggregateEvent(event);
+#elif PERFTIMER_THREAD_BUFFERS
+			// The chain object is owned by the recorder (it has to outlive the thread so
+			// Write() can still reach the events), so the thread_local is only a pointer.
+			// Registration takes the mutex once per thread; after that, recording an event
+			// touches nothing shared with any other thread.
+			static thread_local ThreadEventChain* chain = RegisterThreadChain();
+			if (chain->current == nullptr)
+			{
+#if PERFTIMER_FLIGHT_RECORDER
+				chain->first = AllocateFlightRing();
+#elif PERFTIMER_STREAMING
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					chain->first = AcquireBuffer();
+				}
+#else
+				chain->first = AcquireChainBuffer(chain);
+#endif
+				chain->current = chain->first;
+			}
+			*chain->current->current = event;
+			++chain->current->current;
+			if (chain->current->current >= (chain->current->events + PERFTIMER_BUFFER_SIZE))
+			{
+#if PERFTIMER_FLIGHT_RECORDER
+				chain->current = chain->current->next;
+				chain->current->current = chain->current->events;
+				if (chain->current == chain->first)
+				{
+					chain->wrapped = true;
+				}
+#elif PERFTIMER_STREAMING
+				EnqueueFilledBuffer(chain->current);
+				chain->first = nullptr;
+				chain->current = nullptr;
+#else
+				// Chain pools make the buffer-full boundary entirely thread-private;
+				// no lock, and a fresh allocation first-touches its pages here, on
+				// the recording thread.
+				ProfileEventBuffer* newBuffer = AcquireChainBuffer(chain);
+				chain->current->next = newBuffer;
+				chain->current = newBuffer;
+#endif
+			}
+#if !PERFTIMER_STREAMING
+			++chain->count;
+#endif
+#elif PERFTIMER_BACKEND_LOCKFREE
+			LockFreeEventBuffer* buffer = m_current.load(std::memory_order_acquire);
+			for (;;)
+			{
+				int slot = buffer->claimed.fetch_add(1, std::memory_order_relaxed);
+				if (slot < PERFTIMER_BUFFER_SIZE)
+				{
+					buffer->events[slot] = event;
+					buffer->committed.fetch_add(1, std::memory_order_release);
+					return;
+				}
+				// This buffer is full. Exactly one thread wins the race to link in a
+				// fresh buffer; everyone else chases the next pointer and retries there.
+				LockFreeEventBuffer* next = buffer->next.load(std::memory_order_acquire);
+				if (next == nullptr)
+				{
+					LockFreeEventBuffer* newBuffer = AcquireLockFreeBuffer();
+					if (buffer->next.compare_exchange_strong(next, newBuffer, std::memory_order_release, std::memory_order_acquire))
+					{
+						next = newBuffer;
+					}
+					else
+					{
+						DeleteEventBuffer(newBuffer);
+					}
+				}
+				m_current.compare_exchange_strong(buffer, next, std::memory_order_release, std::memory_order_acquire);
+				buffer = next;
+			}
+#else
+#if PERFTIMER_MULTITHREADED
+			std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+#if PERFTIMER_HITCH_TRIGGER
+			// The boundary closes the frame being staged; judge that frame before
+			// the boundary event opens the next frame's staging chain.
+			if (event.eventType == EventType::FRAME_BOUNDARY)
+			{
+				CloseHitchFrame(event.timestamp);
+			}
+			if (m_stageCurrent == nullptr)
+			{
+				m_stageFirst = AcquireBuffer();
+				m_stageCurrent = m_stageFirst;
+			}
+			*m_stageCurrent->current = event;
+			++m_stageCurrent->current;
+			++m_stageCount;
+			++m_frameStatEvents;
+			if (m_stageCurrent->current >= (m_stageCurrent->events + PERFTIMER_BUFFER_SIZE))
+			{
+				ProfileEventBuffer* newBuffer = AcquireBuffer();
+				m_stageCurrent->next = newBuffer;
+				m_stageCurrent = newBuffer;
+			}
+#else
+			*m_current->current = event;
+			++m_current->current;
+			if (m_current->current >= (m_current->events + PERFTIMER_BUFFER_SIZE))
+			{
+#if PERFTIMER_FLIGHT_RECORDER
+				m_current = m_current->next;
+				m_current->current = m_current->events;
+				if (m_current == m_first)
+				{
+					m_wrapped = true;
+				}
+#elif PERFTIMER_STREAMING
+				EnqueueFilledBuffer(m_current);
+				m_first = nullptr;
+				m_current = AcquireBuffer();
+#else
+				ProfileEventBuffer* newBuffer = AcquireBuffer();
+				m_current->next = newBuffer;
+				m_current = newBuffer;
+#endif
+			}
+#if !PERFTIMER_STREAMING
+			++m_count;
+#endif
+#endif
+#endif
+		}
+
+		static EventRecorder& get()
+		{
+			static EventRecorder recorder;
+			return recorder;
+		}
+
+		static void Start(std::string const& filename)
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			recorder.m_filename = filename;
+#if PERFTIMER_STREAMING
+#ifdef _MSC_VER
+			fopen_s(&recorder.m_output, filename.c_str(), PERFTIMER_FILE_MODE);
+#else
+			recorder.m_output = fopen(filename.c_str(), PERFTIMER_FILE_MODE);
+#endif
+			if (recorder.m_output == nullptr)
+			{
+				perror("Could not open perf_timer output file for writing.");
+				return;
+			}
+#if PERFTIMER_SOCKET
+			recorder.m_outputIsSocket = false;
+#endif
+#endif
+			recorder.BeginCapture();
+		}
+
+#if PERFTIMER_SOCKET
+		// Streams the capture to a live viewer instead of a file. The address is
+		// "host:port" for TCP, or a filesystem path (anything containing a '/')
+		// for a Unix domain socket. On connection failure the recorder just stays
+		// disabled, so an instrumented build runs fine with no viewer listening.
+		static void StartSocket(std::string const& address)
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			recorder.m_filename.clear();
+			const int fd = ConnectSocket(address);
+			if (fd == -1)
+			{
+				return;
+			}
+			recorder.m_output = fdopen(fd, "wb");
+			if (recorder.m_output == nullptr)
+			{
+				perror("Could not wrap perf_timer socket in a stream.");
+				close(fd);
+				return;
+			}
+			recorder.m_outputIsSocket = true;
+			recorder.BeginCapture();
+		}
+#endif
+
+#if PERFTIMER_SHARED_MEMORY
+		// Joins (or, in the first process, creates) the named shared segment and
+		// starts recording into it. The creating process must call this before its
+		// workers do - for a fork server that's natural, since the master starts
+		// first - and every participant must be built with the same segment and
+		// region sizes.
+		static void StartShared(std::string const& segmentName)
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			recorder.m_filename.clear();
+			bool created = true;
+			int fd = shm_open(segmentName.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+			if (fd == -1 && errno == EEXIST)
+			{
+				created = false;
+				fd = shm_open(segmentName.c_str(), O_RDWR, 0600);
+			}
+			if (fd == -1)
+			{
+				perror("Could not open perf_timer shared segment.");
+				return;
+			}
+			if (created && ftruncate(fd, PERFTIMER_SHM_SIZE) != 0)
+			{
+				perror("Could not size perf_timer shared segment.");
+				close(fd);
+				shm_unlink(segmentName.c_str());
+				return;
+			}
+			void* map = mmap(nullptr, PERFTIMER_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			close(fd);
+			if (map == MAP_FAILED)
+			{
+				perror("Could not map perf_timer shared segment.");
+				return;
+			}
+			recorder.m_shm = static_cast<char*>(map);
+			if (created)
+			{
+				SharedSegmentHeader* header = reinterpret_cast<SharedSegmentHeader*>(recorder.m_shm);
+				header->cursor.store(sizeof(SharedSegmentHeader));
+				header->magic = PERFTIMER_SHM_MAGIC;
+			}
+			recorder.BeginCapture();
+		}
+
+		// Combines every process's regions from the named segment into one ordinary
+		// capture file and removes the segment. Call it from the coordinating
+		// process after every participant has called End(). Each process's regions
+		// are spliced back together in carve order and copied record by record, so
+		// the output count is exact even if a process was cut short mid-record.
+		static bool MergeShared(std::string const& segmentName, std::string const& filename)
+		{
+			int fd = shm_open(segmentName.c_str(), O_RDWR, 0600);
+			if (fd == -1)
+			{
+				perror("Could not open perf_timer shared segment for merging.");
+				return false;
+			}
+			void* map = mmap(nullptr, PERFTIMER_SHM_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (map == MAP_FAILED)
+			{
+				perror("Could not map perf_timer shared segment for merging.");
+				return false;
+			}
+			char* segment = static_cast<char*>(map);
+			SharedSegmentHeader const* segmentHeader = reinterpret_cast<SharedSegmentHeader const*>(segment);
+			if (segmentHeader->magic != PERFTIMER_SHM_MAGIC)
+			{
+				fprintf(stderr, "perf_timer: '%s' is not a perf_timer shared segment.\n", segmentName.c_str());
+				munmap(map, PERFTIMER_SHM_SIZE);
+				return false;
+			}
+			FILE* output = fopen(filename.c_str(), "wb+");
+			if (output == nullptr)
+			{
+				perror("Could not open perf_timer output file for writing.");
+				munmap(map, PERFTIMER_SHM_SIZE);
+				return false;
+			}
+			int32_t magic = PERFTIMER_FILE_MAGIC;
+			int32_t countPlaceholder = 0;
+			fwrite(&magic, sizeof(magic), 1, output);
+			fwrite(&countPlaceholder, sizeof(countPlaceholder), 1, output);
+
+			// Reads a process's spliced region stream; records may straddle the
+			// boundary between two of its consecutive regions.
+			struct RegionCursor
+			{
+				std::vector<SharedRegionHeader const*> regions;
+				size_t region{ 0 };
+				size_t offset{ 0 };
+
+				bool Read(void* out, size_t size)
+				{
+					char* bytes = static_cast<char*>(out);
+					while (size > 0)
+					{
+						if (region >= regions.size())
+						{
+							return false;
+						}
+						SharedRegionHeader const* header = regions[region];
+						if (offset == header->used)
+						{
+							++region;
+							offset = 0;
+							continue;
+						}
+						size_t chunk = size;
+						if (chunk > header->used - offset)
+						{
+							chunk = header->used - offset;
+						}
+						memcpy(bytes, reinterpret_cast<char const*>(header + 1) + offset, chunk);
+						offset += chunk;
+						bytes += chunk;
+						size -= chunk;
+					}
+					return true;
+				}
+			};
+
+			const uint64_t stride = sizeof(SharedRegionHeader) + PERFTIMER_SHM_REGION_SIZE;
+			uint64_t end = segmentHeader->cursor.load();
+			if (end > PERFTIMER_SHM_SIZE)
+			{
+				// Failed carves still advanced the cursor; only whole regions exist.
+				end = sizeof(SharedSegmentHeader) + ((PERFTIMER_SHM_SIZE - sizeof(SharedSegmentHeader)) / stride) * stride;
+			}
+			int32_t count = 0;
+			std::vector<int32_t> mergedPids;
+			std::vector<char> record;
+			for (uint64_t offset = sizeof(SharedSegmentHeader); offset + stride <= end; offset += stride)
+			{
+				const int32_t pid = reinterpret_cast<SharedRegionHeader const*>(segment + offset)->pid;
+				bool merged = false;
+				for (int32_t mergedPid : mergedPids)
+				{
+					if (mergedPid == pid)
+					{
+						merged = true;
+						break;
+					}
+				}
+				if (merged)
+				{
+					continue;
+				}
+				mergedPids.push_back(pid);
+				RegionCursor cursor;
+				for (uint64_t other = offset; other + stride <= end; other += stride)
+				{
+					SharedRegionHeader const* header = reinterpret_cast<SharedRegionHeader const*>(segment + other);
+					if (header->pid == pid)
+					{
+						cursor.regions.push_back(header);
+					}
+				}
+				for (;;)
+				{
+					// The v1 record prefix: type, thread id, frame, timestamp, name length.
+					const size_t prefixSize = sizeof(EventType) + sizeof(int64_t) + sizeof(int32_t) + sizeof(int64_t) + sizeof(int16_t);
+					record.resize(prefixSize);
+					if (!cursor.Read(record.data(), prefixSize))
+					{
+						break;
+					}
+					int16_t nameLength;
+					memcpy(&nameLength, record.data() + prefixSize - sizeof(int16_t), sizeof(nameLength));
+					size_t recordSize = prefixSize + nameLength;
+					if (EventCarriesValue(static_cast<EventType>(record[0])))
+					{
+						recordSize += sizeof(int64_t);
+					}
+					record.resize(recordSize);
+					if (!cursor.Read(record.data() + prefixSize, recordSize - prefixSize))
+					{
+						// A process cut short mid-record; keep its complete records.
+						break;
+					}
+					fwrite(record.data(), recordSize, 1, output);
+					++count;
+				}
+			}
+			fseek(output, sizeof(int32_t), SEEK_SET);
+			fwrite(&count, sizeof(count), 1, output);
+			fflush(output);
+			fclose(output);
+			munmap(map, PERFTIMER_SHM_SIZE);
+			shm_unlink(segmentName.c_str());
+			return true;
+		}
+#endif
+
+		static void End()
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			recorder.m_enabled = false;
+			recorder.Write();
+			recorder.ReportFrameStats();
+			recorder.m_count = 0;
+			NameArena::get().Release();
+		}
+
+#if PERFTIMER_STREAMING || (!PERFTIMER_THREAD_BUFFERS && !PERFTIMER_BACKEND_LOCKFREE && !PERFTIMER_AGGREGATE && !PERFTIMER_FLIGHT_RECORDER && !PERFTIMER_HITCH_TRIGGER && !PERFTIMER_SHARED_MEMORY)
+		// Writes everything recorded so far to its own self-contained capture file
+		// and keeps recording - no gap, no re-Start(). A week-long soak session can
+		// checkpoint every few minutes and produce bounded-size segment files, each
+		// carrying its own header, thread-name replay and (in format 2+) name
+		// table, so every segment parses like any standalone capture. Dynamic name
+		// storage (CloneStr) is released only at End() and persists across
+		// checkpoints. Call it from one thread at a time.
+		//
+		// With streaming, the rotation runs on the flusher thread once it has
+		// drained everything queued ahead of it; events recorded around the call
+		// land in whichever segment the flusher reaches first, per-thread tail
+		// buffers stay with their owners until they fill, and requests arriving
+		// faster than the flusher can rotate coalesce into the newest one - no
+		// events are lost, the segment boundary just moves. With the default mutex
+		// backend the chain is detached under the recorder lock - the same lock
+		// every event takes - and serialized from the calling thread while
+		// recording continues into a fresh chain. The remaining backends record
+		// without any lock under which a consistent chain could be detached (the
+		// flight recorder has Dump() for this job instead), so there Checkpoint()
+		// is not compiled.
+		static void Checkpoint(std::string const& filename)
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			if (!recorder.m_enabled)
+			{
+				return;
+			}
+#if PERFTIMER_STREAMING
+#if PERFTIMER_SOCKET
+			// A live socket stream has no file to rotate; the receiving end can
+			// segment however it likes.
+			if (recorder.m_outputIsSocket)
+			{
+				return;
+			}
+#endif
+#if !PERFTIMER_THREAD_BUFFERS
+			// Hand the partially-filled buffer to the flusher so the segment is
+			// current up to this call.
+			{
+#if PERFTIMER_MULTITHREADED
+				std::lock_guard<std::mutex> lock(recorder.m_mutex);
+#endif
+				if (recorder.m_current != nullptr)
+				{
+					recorder.EnqueueFilledBuffer(recorder.m_current);
+					recorder.m_first = nullptr;
+					recorder.m_current = recorder.AcquireBuffer();
+				}
+			}
+#endif
+			{
+				std::lock_guard<std::mutex> lock(recorder.m_flushMutex);
+				recorder.m_rotateTo = filename;
+			}
+			recorder.m_flushCondition.notify_one();
+#else
+			ProfileEventBuffer* first;
+			int32_t count;
+			{
+#if PERFTIMER_MULTITHREADED
+				std::lock_guard<std::mutex> lock(recorder.m_mutex);
+#endif
+				if (recorder.m_count == 0)
+				{
+					return;
+				}
+				first = recorder.m_first;
+				count = recorder.m_count;
+				recorder.m_first = recorder.AcquireBuffer();
+				recorder.m_current = recorder.m_first;
+				recorder.m_count = 0;
+			}
+			recorder.WriteDetached(first, count, filename);
+#endif
+		}
+#endif
+
+		// Marks the start of a new frame. Every event recorded after this call is
+		// stamped with the new frame id, and the boundary itself is recorded so
+		// the viewer and the end-of-capture statistics know exactly where frames
+		// begin. Call it once per frame, from the thread that drives the frame.
+		static void FrameMark()
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			const int32_t frame = recorder.m_frameCounter.fetch_add(1, std::memory_order_relaxed) + 1;
+#if PERFTIMER_MULTITHREADED
+#	ifdef _MSC_VER
+			const int64_t threadId = static_cast<int64_t>(GetCurrentThreadId());
+#	else
+			const int64_t threadId = static_cast<int64_t>(pthread_self());
+#	endif
+#else
+			const int64_t threadId = 0;
+#endif
+			recorder.AddEvent({ EventType::FRAME_BOUNDARY, threadId, frame, Now(), "frame" });
+		}
+
+		// The id of the frame currently being recorded: -1 until the first
+		// FrameMark() of the capture, which is also what "no frame-based
+		// profiling" looks like to the viewer.
+		static int32_t CurrentFrame()
+		{
+			return EventRecorder::get().m_frameCounter.load(std::memory_order_relaxed);
+		}
+
+		// Registers a human-readable name for the calling thread. The name goes
+		// into a small metadata table - once per thread, not stamped on every
+		// event - and each capture file carries the table as THREAD_NAME records,
+		// so the viewer titles the thread's report "RenderThread" instead of a
+		// raw id. The table survives End(): register once at thread startup and
+		// every capture the process takes picks the names up.
+		static void SetThreadName(char const* name)
+		{
+			EventRecorder& recorder = EventRecorder::get();
+#if PERFTIMER_MULTITHREADED
+#	ifdef _MSC_VER
+			const int64_t threadId = static_cast<int64_t>(GetCurrentThreadId());
+#	else
+			const int64_t threadId = static_cast<int64_t>(pthread_self());
+#	endif
+			{
+				std::lock_guard<std::mutex> lock(recorder.m_mutex);
+				recorder.m_threadNames[threadId] = name;
+			}
+#else
+			const int64_t threadId = 0;
+			recorder.m_threadNames[threadId] = name;
+#endif
+#if PERFTIMER_STREAMING
+			// A stream can't be rewound to splice the table in later, so a thread
+			// named mid-capture also records a live metadata event; threads named
+			// before Start() are covered by the replay at the head of the stream.
+			if (recorder.m_enabled)
+			{
+				recorder.AddEvent({ EventType::THREAD_NAME, threadId, CurrentFrame(), Now(), CloneStr(name) });
+			}
+#endif
+		}
+
+#if PERFTIMER_FLIGHT_RECORDER
+		// Writes whatever the flight ring currently holds - the most recent events -
+		// to the given file and resets the ring. Intended to be called from a hitch
+		// or assert handler while recording continues.
+		static void Dump(std::string const& filename)
+		{
+			EventRecorder::get().WriteFlight(filename);
+		}
+#endif
+
+#if PERFTIMER_CRASH_DUMP
+		// Opens the dump file ahead of time, from normal code (e.g. right after
+		// Start()), so that the signal handler never has to touch the filesystem
+		// namespace. Safe to call again to rotate the file.
+		static void PrepareCrashDump(char const* filename)
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			if (recorder.m_crashFd != -1)
+			{
+				close(recorder.m_crashFd);
+			}
+			recorder.m_crashFd = open(filename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+			if (recorder.m_crashFd == -1)
+			{
+				perror("Could not open perf_timer crash dump file.");
+			}
+		}
+
+		// Salvages the recorded events from a signal handler. Every call below is
+		// async-signal-safe: raw write(2) on the pre-opened descriptor, strlen and
+		// memcpy - no stdio, no allocation, and no locking against a thread that
+		// may have died holding a lock. The dump is best-effort: an event another
+		// thread was mid-way through recording at the moment of the crash can be
+		// torn or missing, but the header count is patched from the events actually
+		// written, so the file always parses. Always emits format version 1 (name
+		// interning would allocate).
+		static void CrashDump()
+		{
+			EventRecorder& recorder = EventRecorder::get();
+			const int fd = recorder.m_crashFd;
+			if (fd == -1)
+			{
+				return;
+			}
+			recorder.m_enabled = false;
+			const int32_t magic = 0xFA57;
+			int32_t count = 0;
+			CrashWrite(fd, &magic, sizeof(magic));
+			CrashWrite(fd, &count, sizeof(count));
+#if PERFTIMER_THREAD_BUFFERS
+			for (ThreadEventChain* chain = recorder.m_chains; chain != nullptr; chain = chain->nextChain)
+			{
+#if PERFTIMER_FLIGHT_RECORDER
+				count += CrashWriteRing(fd, chain->first, chain->current, chain->wrapped);
+#else
+				count += CrashWriteChain(fd, chain->first);
+#endif
+			}
+#elif PERFTIMER_BACKEND_LOCKFREE
+			for (LockFreeEventBuffer* buffer = recorder.m_first; buffer != nullptr; buffer = buffer->next.load(std::memory_order_acquire))
+			{
+				const int committed = buffer->committed.load(std::memory_order_acquire);
+				for (int i = 0; i < committed; ++i)
+				{
+					CrashWriteEvent(fd, buffer->events + i);
+				}
+				count += committed;
+			}
+#elif PERFTIMER_FLIGHT_RECORDER
+			count += CrashWriteRing(fd, recorder.m_first, recorder.m_current, recorder.m_wrapped);
+#else
+			count += CrashWriteChain(fd, recorder.m_first);
+#if PERFTIMER_HITCH_TRIGGER
+			// The frames still awaiting judgement - the rolling window and the frame
+			// being recorded - are exactly the run-up to the crash; salvage them too.
+			for (int i = 0; i < recorder.m_hitchWindowSize; ++i)
+			{
+				count += CrashWriteChain(fd, recorder.m_hitchWindow[i].first);
+			}
+			count += CrashWriteChain(fd, recorder.m_stageFirst);
+#endif
+#endif
+			if (lseek(fd, sizeof(magic), SEEK_SET) != -1)
+			{
+				CrashWrite(fd, &count, sizeof(count));
+			}
+			fsync(fd);
+		}
+#endif
+
+		void Write()
+		{
+#if PERFTIMER_AGGREGATE
+			WriteAggregate();
+#elif PERFTIMER_FLIGHT_RECORDER
+			WriteFlight(m_filename);
+#elif PERFTIMER_STREAMING
+			if (m_output == nullptr && !m_flushThread.joinable())
+			{
+				// Start() never opened an output. (A null output with a live flusher
+				// means a checkpoint rotation failed mid-session; the flusher still
+				// needs its shutdown handshake below.)
+				return;
+			}
+			// Hand the partially-filled tail buffers to the flusher, then wait for it
+			// to drain before finalizing the header.
+#if PERFTIMER_THREAD_BUFFERS
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				for (ThreadEventChain* chain = m_chains; chain != nullptr; chain = chain->nextChain)
+				{
+					if (chain->current != nullptr)
+					{
+						EnqueueFilledBuffer(chain->current);
+						chain->first = nullptr;
+						chain->current = nullptr;
+					}
+				}
+			}
+#else
+			if (m_current != nullptr)
+			{
+				EnqueueFilledBuffer(m_current);
+				m_first = nullptr;
+				m_current = nullptr;
+			}
+#endif
+			{
+				std::lock_guard<std::mutex> lock(m_flushMutex);
+				m_flushExit = true;
+			}
+			m_flushCondition.notify_one();
+			m_flushThread.join();
+			if (m_serializer != nullptr)
+			{
+#if PERFTIMER_SOCKET
+				// A socket reader parses to the end of the stream, so a footer
+				// there would be mistaken for events.
+				if (!m_outputIsSocket)
+#endif
+				{
+					WriteFrameIndex(*m_serializer);
+				}
+			}
+			delete m_serializer;
+			m_serializer = nullptr;
+			if (m_output != nullptr)
+			{
+#if PERFTIMER_SOCKET
+				// A live stream has no seekable header to patch; the receiver reads
+				// until the connection closes instead of trusting the count.
+				if (!m_outputIsSocket)
+#endif
+				{
+					fseek(m_output, sizeof(int32_t), SEEK_SET);
+					fwrite(&m_count, sizeof(m_count), 1, m_output);
+				}
+				fflush(m_output);
+				fclose(m_output);
+				m_output = nullptr;
+			}
+#if PERFTIMER_STREAM_QUEUE_LIMIT
+			if (m_droppedBuffers > 0)
+			{
+				fprintf(stderr, "perf_timer: dropped %d full buffers; the stream consumer could not keep up.\n", m_droppedBuffers);
+			}
+#endif
+#else
+#if PERFTIMER_THREAD_BUFFERS
+			std::lock_guard<std::mutex> lock(m_mutex);
+			int count = 0;
+			for (ThreadEventChain* chain = m_chains; chain != nullptr; chain = chain->nextChain)
+			{
+				count += chain->count;
+			}
+#elif PERFTIMER_BACKEND_LOCKFREE
+			// 'committed' only equals the number of usable slots once recording has
+			// stopped, which is the same quiescence every write path here assumes.
+			int count = 0;
+			for (LockFreeEventBuffer* buffer = m_first; buffer != nullptr; buffer = buffer->next.load(std::memory_order_acquire))
+			{
+				count += buffer->committed.load(std::memory_order_acquire);
+			}
+#else
+#if PERFTIMER_HITCH_TRIGGER
+			// Whatever is still staged never earned retention; return its buffers
+			// before writing out the hitches.
+			DiscardPendingHitchFrames();
+#endif
+			int count = m_count;
+#endif
+			if (count == 0)
+			{
+				return;
+			}
+#if PERFTIMER_SHARED_MEMORY
+			if (m_shm == nullptr)
+			{
+				return;
+			}
+			// No file and no header: the events go into carved segment regions, and
+			// MergeShared() writes the header when it assembles the capture file,
+			// counting the name records along with everything else. The pid is read
+			// here rather than in StartShared(): a fork server maps the segment in
+			// the master before forking, so a pid cached at start would stamp every
+			// child's regions and thread ids with the master's pid.
+			m_pid = static_cast<int32_t>(getpid());
+			EventSerializer serializer(m_shm, m_pid);
+#else
+#ifdef _MSC_VER
+			FILE* output;
+			fopen_s(&output, m_filename.c_str(), PERFTIMER_FILE_MODE);
+#else
+			FILE* output = fopen(m_filename.c_str(), PERFTIMER_FILE_MODE);
+#endif
+			if (output == nullptr)
+			{
+				perror("Could not open perf_timer output file for writing.");
+				return;
+			}
+			count += static_cast<int32_t>(m_threadNames.size());
+			WriteFileHeader(output, count);
+			EventSerializer serializer(output);
+			ResetFrameIndex();
+#endif
+			WriteThreadNames(serializer);
+#if PERFTIMER_THREAD_BUFFERS
+			// Events carry their thread id, so the chains can simply be concatenated -
+			// the viewer only requires that each thread's own events stay in order.
+			for (ThreadEventChain* chain = m_chains; chain != nullptr; chain = chain->nextChain)
+			{
+				WriteBufferChain(chain->first, serializer, chain);
+				chain->first = nullptr;
+				chain->current = nullptr;
+				chain->count = 0;
+			}
+#elif PERFTIMER_BACKEND_LOCKFREE
+			LockFreeEventBuffer* buffer = m_first;
+			while (buffer != nullptr)
+			{
+				ProfileEvent* event = buffer->events;
+				ProfileEvent* bufferEnd = buffer->events + buffer->committed.load(std::memory_order_acquire);
+				while (event < bufferEnd)
+				{
+					WriteEvent(event, serializer);
+					++event;
+				}
+				LockFreeEventBuffer* oldBuffer = buffer;
+				buffer = buffer->next.load(std::memory_order_acquire);
+				ReleaseLockFreeBuffer(oldBuffer);
+			}
+			m_first = nullptr;
+			m_current.store(nullptr, std::memory_order_release);
+#else
+			WriteBufferChain(m_first, serializer);
+#endif
+#if !PERFTIMER_SHARED_MEMORY
+			WriteFrameIndex(serializer);
+#endif
+			serializer.Flush();
+#if PERFTIMER_SHARED_MEMORY
+			munmap(m_shm, PERFTIMER_SHM_SIZE);
+			m_shm = nullptr;
+#else
+			fflush(output);
+			fclose(output);
+#endif
+#endif
+		}
+
+	private:
+
+		// Shared tail of Start() and StartSocket(): reset per-session state, write
+		// the stream header and spawn the flusher (when streaming, with m_output
+		// already open), stand up the configured backend, and open the gate.
+		void BeginCapture()
+		{
+#if PERFTIMER_FORMAT_VERSION >= 2
+			m_nameIds.clear();
+			m_dynamicNameIds.clear();
+			m_nextNameId = 0;
+#endif
+#if PERFTIMER_FORMAT_VERSION >= 3
+			m_chunkThreadId = INT64_MIN;
+			m_chunkFrameId = INT32_MIN;
+#endif
+			m_frameCounter.store(-1, std::memory_order_relaxed);
+			ResetFrameStats();
+#if PERFTIMER_STREAMING
+			// The count isn't known until the capture ends; for file output it gets
+			// patched over this placeholder once the flusher has drained. A socket
+			// can't seek back, so there the receiver reads until the connection
+			// closes and ignores the placeholder.
+			WriteFileHeader(m_output, 0);
+			m_serializer = new EventSerializer(m_output);
+			ResetFrameIndex();
+			// Threads named before the capture began replay at the head of the
+			// stream; the flusher isn't running yet, so the serializer is free.
+			WriteThreadNames(*m_serializer);
+			m_count = static_cast<int32_t>(m_threadNames.size());
+			m_flushExit = false;
+			m_rotateTo.clear();
+#if PERFTIMER_STREAM_QUEUE_LIMIT
+			m_readyCount = 0;
+			m_droppedBuffers = 0;
+#endif
+			m_flushThread = std::thread([this]() { FlushThreadMain(); });
+#endif
+#if PERFTIMER_BACKEND_LOCKFREE
+			m_first = AcquireLockFreeBuffer();
+			m_current.store(m_first, std::memory_order_release);
+#elif !PERFTIMER_THREAD_BUFFERS && !PERFTIMER_AGGREGATE
+#if PERFTIMER_FLIGHT_RECORDER
+			// The ring survives End()/Dump(), so only allocate it once.
+			if (m_first == nullptr)
+			{
+				m_first = AllocateFlightRing();
+			}
+			m_wrapped = false;
+#elif PERFTIMER_HITCH_TRIGGER
+			// The retained chain stays empty until a frame hitches; staging draws
+			// its first buffer at the first event.
+			m_first = nullptr;
+#else
+			m_first = AcquireBuffer();
+#endif
+			m_current = m_first;
+#endif
+			m_enabled = true;
+		}
+
+#if PERFTIMER_SOCKET
+		// Resolves and connects the given address, returning a connected stream
+		// socket or -1. "host:port" dials TCP (IPv4 or IPv6, whichever resolves);
+		// a path containing a '/' dials a Unix domain socket.
+		static int ConnectSocket(std::string const& address)
+		{
+			if (address.find('/') != std::string::npos)
+			{
+				const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+				if (fd == -1)
+				{
+					perror("Could not create perf_timer socket.");
+					return -1;
+				}
+				sockaddr_un addr;
+				memset(&addr, 0, sizeof(addr));
+				addr.sun_family = AF_UNIX;
+				snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", address.c_str());
+				if (connect(fd, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) == -1)
+				{
+					perror("Could not connect perf_timer socket.");
+					close(fd);
+					return -1;
+				}
+				return fd;
+			}
+
+			const size_t colon = address.rfind(':');
+			if (colon == std::string::npos)
+			{
+				fprintf(stderr, "perf_timer: socket address '%s' is neither host:port nor a Unix socket path.\n", address.c_str());
+				return -1;
+			}
+			const std::string host = address.substr(0, colon);
+			const std::string port = address.substr(colon + 1);
+			addrinfo hints;
+			memset(&hints, 0, sizeof(hints));
+			hints.ai_family = AF_UNSPEC;
+			hints.ai_socktype = SOCK_STREAM;
+			addrinfo* results = nullptr;
+			const int resolved = getaddrinfo(host.c_str(), port.c_str(), &hints, &results);
+			if (resolved != 0)
+			{
+				fprintf(stderr, "perf_timer: could not resolve '%s': %s\n", address.c_str(), gai_strerror(resolved));
+				return -1;
+			}
+			int fd = -1;
+			for (addrinfo* info = results; info != nullptr; info = info->ai_next)
+			{
+				fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+				if (fd == -1)
+				{
+					continue;
+				}
+				if (connect(fd, info->ai_addr, info->ai_addrlen) == 0)
+				{
+					break;
+				}
+				close(fd);
+				fd = -1;
+			}
+			freeaddrinfo(results);
+			if (fd == -1)
+			{
+				perror("Could not connect perf_timer socket.");
+			}
+			return fd;
+		}
+#endif
+
+#if PERFTIMER_CRASH_DUMP
+		static void CrashWrite(int fd, void const* data, size_t size)
+		{
+			char const* bytes = static_cast<char const*>(data);
+			while (size > 0)
+			{
+				const ssize_t written = write(fd, bytes, size);
+				if (written < 0 && errno == EINTR)
+				{
+					continue;
+				}
+				if (written <= 0)
+				{
+					return;
+				}
+				bytes += written;
+				size -= static_cast<size_t>(written);
+			}
+		}
+
+		static void CrashWriteEvent(int fd, ProfileEvent const* event)
+		{
+#if PERFTIMER_CLOCK_TSC
+			// Pure arithmetic on calibration data that was initialized long before
+			// the crash, so this is safe here too.
+			ProfileEvent converted = *event;
+			converted.timestamp = internal_::TscToNanoseconds(event->timestamp);
+			event = &converted;
+#endif
+			unsigned char prefix[21];
+			CrashWrite(fd, prefix, PackEventPrefix(event, prefix));
+			int16_t len = static_cast<int16_t>(strlen(event->name));
+			if (event->name[0] == '\1')
+			{
+				--len;
+				CrashWrite(fd, &len, sizeof(len));
+				CrashWrite(fd, event->name + 1, len);
+			}
+			else
+			{
+				CrashWrite(fd, &len, sizeof(len));
+				CrashWrite(fd, event->name, len);
+			}
+			if (EventCarriesValue(event->eventType))
+			{
+				const int64_t value = event->value;
+				CrashWrite(fd, &value, sizeof(value));
+			}
+		}
+
+#if !PERFTIMER_BACKEND_LOCKFREE
+		static int32_t CrashWriteChain(int fd, ProfileEventBuffer* buffer)
+		{
+			int32_t count = 0;
+			while (buffer != nullptr)
+			{
+				// Snapshot the cursor once so the events written match the events
+				// counted even if a recording thread is still moving it.
+				ProfileEvent const* end = buffer->current;
+				for (ProfileEvent const* event = buffer->events; event < end; ++event)
+				{
+					CrashWriteEvent(fd, event);
+					++count;
+				}
+				buffer = buffer->next;
+			}
+			return count;
+		}
+#endif
+
+#if PERFTIMER_FLIGHT_RECORDER
+		static int32_t CrashWriteRing(int fd, ProfileEventBuffer* first, ProfileEventBuffer* current, bool wrapped)
+		{
+			if (first == nullptr)
+			{
+				return 0;
+			}
+			int32_t count = 0;
+			ProfileEventBuffer* buffer = wrapped ? current->next : first;
+			for (;;)
+			{
+				ProfileEvent const* end = buffer->current;
+				for (ProfileEvent const* event = buffer->events; event < end; ++event)
+				{
+					CrashWriteEvent(fd, event);
+					++count;
+				}
+				if (buffer == current)
+				{
+					return count;
+				}
+				buffer = buffer->next;
+			}
+		}
+#endif
+#endif
+
+#if PERFTIMER_FLIGHT_RECORDER
+		void WriteFlight(std::string const& filename)
+		{
+#if PERFTIMER_MULTITHREADED
+			std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+			int count = 0;
+#if PERFTIMER_THREAD_BUFFERS
+			for (ThreadEventChain* chain = m_chains; chain != nullptr; chain = chain->nextChain)
+			{
+				count += CountRing(chain->first, chain->current, chain->wrapped);
+			}
+#else
+			count = CountRing(m_first, m_current, m_wrapped);
+#endif
+			if (count == 0)
+			{
+				return;
+			}
+#ifdef _MSC_VER
+			FILE* output;
+			fopen_s(&output, filename.c_str(), PERFTIMER_FILE_MODE);
+#else
+			FILE* output = fopen(filename.c_str(), PERFTIMER_FILE_MODE);
+#endif
+			if (output == nullptr)
+			{
+				perror("Could not open perf_timer output file for writing.");
+				return;
+			}
+			count += static_cast<int32_t>(m_threadNames.size());
+			WriteFileHeader(output, count);
+#if PERFTIMER_FORMAT_VERSION >= 2
+			// Each dump is a self-contained file; its name table starts from scratch.
+			m_nameIds.clear();
+			m_dynamicNameIds.clear();
+			m_nextNameId = 0;
+#endif
+#if PERFTIMER_FORMAT_VERSION >= 3
+			m_chunkThreadId = INT64_MIN;
+			m_chunkFrameId = INT32_MIN;
+#endif
+			// Statistics likewise restart per dump, so End() only reports the
+			// frames recorded since the last Dump().
+			ResetFrameStats();
+			EventSerializer serializer(output);
+			ResetFrameIndex();
+			WriteThreadNames(serializer);
+#if PERFTIMER_THREAD_BUFFERS
+			for (ThreadEventChain* chain = m_chains; chain != nullptr; chain = chain->nextChain)
+			{
+				WriteRing(chain->first, chain->current, chain->wrapped, serializer);
+				chain->current = chain->first;
+				chain->wrapped = false;
+				chain->count = 0;
+			}
+#else
+			WriteRing(m_first, m_current, m_wrapped, serializer);
+			m_current = m_first;
+			m_wrapped = false;
+#endif
+			WriteFrameIndex(serializer);
+			serializer.Flush();
+			fflush(output);
+			fclose(output);
+		}
+
+		int CountRing(ProfileEventBuffer* first, ProfileEventBuffer* current, bool wrapped)
+		{
+			if (first == nullptr)
+			{
+				return 0;
+			}
+			ProfileEventBuffer* buffer = wrapped ? current->next : first;
+			int count = 0;
+			for (;;)
+			{
+				count += static_cast<int>(buffer->current - buffer->events);
+				if (buffer == current)
+				{
+					break;
+				}
+				buffer = buffer->next;
+			}
+			return count;
+		}
+
+		// Walks the ring from the oldest surviving block around to the current one,
+		// serializing and resetting each buffer as it goes.
+		void WriteRing(ProfileEventBuffer* first, ProfileEventBuffer* current, bool wrapped, EventSerializer& serializer)
+		{
+			if (first == nullptr)
+			{
+				return;
+			}
+			ProfileEventBuffer* buffer = wrapped ? current->next : first;
+			for (;;)
+			{
+				for (ProfileEvent* event = buffer->events; event < buffer->current; ++event)
+				{
+					WriteEvent(event, serializer);
+				}
+				buffer->current = buffer->events;
+				if (buffer == current)
+				{
+					break;
+				}
+				buffer = buffer->next;
+			}
+		}
+#endif
+
+#if PERFTIMER_STREAMING
+		void EnqueueFilledBuffer(ProfileEventBuffer* buffer)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_flushMutex);
+#if PERFTIMER_STREAM_QUEUE_LIMIT
+				if (m_readyCount >= PERFTIMER_STREAM_QUEUE_LIMIT)
+				{
+					// Dropping a buffer beats stalling every recording thread behind
+					// a slow consumer; the viewer just sees a gap in the capture. The
+					// pool push is inlined here because ReleaseBuffer would retake
+					// m_flushMutex.
+					++m_droppedBuffers;
+#if PERFTIMER_POOL_BUFFERS
+					buffer->current = buffer->events;
+					buffer->next = m_bufferPool;
+					m_bufferPool = buffer;
+#else
+					DeleteEventBuffer(buffer);
+#endif
+					return;
+				}
+				++m_readyCount;
+#endif
+				buffer->next = nullptr;
+				if (m_readyLast != nullptr)
+				{
+					m_readyLast->next = buffer;
+				}
+				else
+				{
+					m_readyFirst = buffer;
+				}
+				m_readyLast = buffer;
+			}
+			m_flushCondition.notify_one();
+		}
+
+		void FlushThreadMain()
+		{
+			std::unique_lock<std::mutex> lock(m_flushMutex);
+			for (;;)
+			{
+				m_flushCondition.wait(lock, [this] { return m_readyFirst != nullptr || !m_rotateTo.empty() || m_flushExit; });
+				while (m_readyFirst != nullptr)
+				{
+					ProfileEventBuffer* buffer = m_readyFirst;
+					m_readyFirst = buffer->next;
+					if (m_readyFirst == nullptr)
+					{
+						m_readyLast = nullptr;
+					}
+#if PERFTIMER_STREAM_QUEUE_LIMIT
+					--m_readyCount;
+#endif
+					lock.unlock();
+					// A null serializer means a checkpoint rotation failed to open
+					// its file; the rest of the session just drains to the pool.
+					if (m_serializer != nullptr)
+					{
+						ProfileEvent* event = buffer->events;
+						while (event < buffer->current)
+						{
+							WriteEvent(event, *m_serializer);
+							++m_count;
+							++event;
+						}
+					}
+					ReleaseBuffer(buffer);
+					lock.lock();
+				}
+				if (!m_rotateTo.empty())
+				{
+					const std::string filename = m_rotateTo;
+					m_rotateTo.clear();
+					lock.unlock();
+					RotateStream(filename);
+					lock.lock();
+				}
+				if (m_flushExit)
+				{
+					return;
+				}
+			}
+		}
+
+		// Runs on the flusher thread with the queue drained and m_flushMutex
+		// released: finalizes the current output exactly the way End() finalizes
+		// a capture - count patched over the placeholder - renames it to the
+		// requested segment name, and reopens the session file fresh the way
+		// BeginCapture() opens a stream, with fresh interning state and a
+		// thread-name replay at its head.
+		void RotateStream(std::string const& filename)
+		{
+			WriteFrameIndex(*m_serializer);
+			delete m_serializer;
+			m_serializer = nullptr;
+			fseek(m_output, sizeof(int32_t), SEEK_SET);
+			fwrite(&m_count, sizeof(m_count), 1, m_output);
+			fflush(m_output);
+			fclose(m_output);
+			if (rename(m_filename.c_str(), filename.c_str()) != 0)
+			{
+				// The segment is finalized and safe under the session filename;
+				// reopening that name would destroy it, so stop recording instead.
+				perror("Could not rename perf_timer checkpoint segment.");
+				m_output = nullptr;
+				m_enabled = false;
+				return;
+			}
+#ifdef _MSC_VER
+			fopen_s(&m_output, m_filename.c_str(), PERFTIMER_FILE_MODE);
+#else
+			m_output = fopen(m_filename.c_str(), PERFTIMER_FILE_MODE);
+#endif
+			if (m_output == nullptr)
+			{
+				// The closed segments are safe on disk; without a successor there
+				// is nowhere for further events to go, so stop recording them.
+				perror("Could not reopen perf_timer output file after checkpoint.");
+				m_enabled = false;
+				return;
+			}
+#if PERFTIMER_FORMAT_VERSION >= 2
+			m_nameIds.clear();
+			m_dynamicNameIds.clear();
+			m_nextNameId = 0;
+#endif
+#if PERFTIMER_FORMAT_VERSION >= 3
+			m_chunkThreadId = INT64_MIN;
+			m_chunkFrameId = INT32_MIN;
+#endif
+			WriteFileHeader(m_output, 0);
+			m_serializer = new EventSerializer(m_output);
+			ResetFrameIndex();
+			{
+#if PERFTIMER_MULTITHREADED
+				// Unlike in BeginCapture(), recording threads are live and may be
+				// registering names right now.
+				std::lock_guard<std::mutex> nameLock(m_mutex);
+#endif
+				WriteThreadNames(*m_serializer);
+				m_count = static_cast<int32_t>(m_threadNames.size());
+			}
+		}
+#endif
+
+		// Event types that carry an 8-byte payload after the name or name index:
+		// counters (the metric value) and sampled enters (the sample rate).
+		static bool EventCarriesValue(EventType eventType)
+		{
+			return eventType == EventType::COUNTER || eventType == EventType::COUNTER_FLOAT
+				|| eventType == EventType::SAMPLED_ENTER;
+		}
+
+		// Per-frame statistics, gathered as Write() runs the events past the
+		// serializer. Per-thread chains are written one thread at a time, so
+		// boundary events can reach this out of timestamp order; negative
+		// intervals are skipped rather than polluting the minimum.
+		void RecordFrameStat(int64_t timestamp)
+		{
+			if (m_frameStatCount > 0)
+			{
+				const int64_t interval = timestamp - m_framePrevTimestamp;
+				if (interval >= 0)
+				{
+					if (interval < m_frameMinNs)
+					{
+						m_frameMinNs = interval;
+					}
+					if (interval > m_frameMaxNs)
+					{
+						m_frameMaxNs = interval;
+					}
+					m_frameTotalNs += interval;
+					++m_frameIntervals;
+				}
+			}
+			m_framePrevTimestamp = timestamp;
+			++m_frameStatCount;
+		}
+
+		void ResetFrameStats()
+		{
+			m_frameStatCount = 0;
+			m_frameIntervals = 0;
+			m_frameStatEvents = 0;
+			m_framePrevTimestamp = 0;
+			m_frameMinNs = INT64_MAX;
+			m_frameMaxNs = 0;
+			m_frameTotalNs = 0;
+		}
+
+		void ReportFrameStats()
+		{
+			if (m_frameIntervals == 0)
+			{
+				return;
+			}
+			printf("perf_timer: %d frames: avg %.2f ms, min %.2f ms, max %.2f ms, %lld events/frame.\n",
+				m_frameIntervals,
+				double(m_frameTotalNs) / double(m_frameIntervals) / 1e6,
+				double(m_frameMinNs) / 1e6,
+				double(m_frameMaxNs) / 1e6,
+				static_cast<long long>(m_frameStatEvents / m_frameIntervals));
+		}
+
+		// Writes the capture file header. Compressed captures open with the
+		// container magic and carry the inner format's magic after the count;
+		// the count sits at byte offset 4 in both layouts, so the streaming
+		// patch at End() seeks to the same place either way.
+		// Assembles the packed on-disk event prefix - type, thread id, frame,
+		// timestamp, with no padding - from the naturally aligned in-memory
+		// struct. Plain memcpy so the crash-dump path can use it from a signal
+		// handler. Returns the number of bytes written into out.
+		static size_t PackEventPrefix(ProfileEvent const* event, unsigned char* out)
+		{
+			out[0] = static_cast<unsigned char>(event->eventType);
+			memcpy(out + 1, &event->threadId, sizeof(int64_t));
+			memcpy(out + 1 + sizeof(int64_t), &event->frameCount, sizeof(int32_t));
+			memcpy(out + 1 + sizeof(int64_t) + sizeof(int32_t), &event->timestamp, sizeof(int64_t));
+			return 1 + sizeof(int64_t) + sizeof(int32_t) + sizeof(int64_t);
+		}
+
+		static void WriteFileHeader(FILE* output, int32_t count)
+		{
+#if PERFTIMER_COMPRESS
+			const int32_t magic = PERFTIMER_COMPRESS_MAGIC;
+			const int32_t innerMagic = PERFTIMER_FILE_MAGIC;
+			fwrite(&magic, sizeof(magic), 1, output);
+			fwrite(&count, sizeof(count), 1, output);
+			fwrite(&innerMagic, sizeof(innerMagic), 1, output);
+#else
+			const int32_t magic = PERFTIMER_FILE_MAGIC;
+			fwrite(&magic, sizeof(magic), 1, output);
+			fwrite(&count, sizeof(count), 1, output);
+#endif
+		}
+
+#if !PERFTIMER_AGGREGATE
+		// Replays the thread-name table into the stream as THREAD_NAME records,
+		// ahead of the events. The viewer doesn't rely on the position - a name
+		// applies to the whole report, not to a point in time - so the timestamp
+		// and frame are don't-cares.
+		void WriteThreadNames(EventSerializer& serializer)
+		{
+			for (auto const& entry : m_threadNames)
+			{
+				ProfileEvent event{ EventType::THREAD_NAME, entry.first, -1, 0, entry.second.c_str() };
+				WriteEvent(&event, serializer);
+			}
+		}
+#endif
+
+#if !PERFTIMER_AGGREGATE && !PERFTIMER_SHARED_MEMORY
+		// Call when a serializer begins a new file; the index describes exactly
+		// one file's stream.
+		void ResetFrameIndex()
+		{
+			m_indexRanges.clear();
+			m_indexBoundaries.clear();
+			m_indexFrameId = INT32_MIN;
+			m_indexRangeStart = 0;
+			m_indexRangeEvents = 0;
+		}
+
+		// Called for every event as it reaches the serializer: notes frame
+		// boundaries and opens a new index range whenever the stream switches to
+		// a different frame id.
+		void TrackFrameIndex(ProfileEvent const* event, EventSerializer& serializer)
+		{
+			if (event->eventType == EventType::FRAME_BOUNDARY)
+			{
+				m_indexBoundaries.push_back({ event->frameCount, event->timestamp });
+			}
+			if (event->frameCount != m_indexFrameId)
+			{
+				if (m_indexRangeEvents != 0)
+				{
+					m_indexRanges.push_back({ m_indexFrameId, m_indexRangeStart, m_indexRangeEvents });
+				}
+				m_indexFrameId = event->frameCount;
+				m_indexRangeStart = serializer.BytesWritten();
+				m_indexRangeEvents = 0;
+#if PERFTIMER_FORMAT_VERSION >= 3
+				// Force a full chunk record at the range start so the range
+				// decodes with no context from earlier in the stream; a seeking
+				// reader lands on a fresh thread id and timestamp base.
+				m_chunkThreadId = INT64_MIN;
+#endif
+			}
+			++m_indexRangeEvents;
+		}
+
+		// Appends the index footer after the last event: every range, every
+		// boundary, and (format 2+) the complete name table in id order - a
+		// range's events reference names interned anywhere earlier in the file,
+		// so a seeking reader needs the whole table up front. The footer closes
+		// with its own stream offset and the magic again, so a reader locates it
+		// from the end of the stream in one seek; readers that read exactly
+		// 'count' events from the header never encounter it.
+		void WriteFrameIndex(EventSerializer& serializer)
+		{
+			if (m_indexRangeEvents != 0)
+			{
+				m_indexRanges.push_back({ m_indexFrameId, m_indexRangeStart, m_indexRangeEvents });
+				m_indexRangeEvents = 0;
+			}
+			const int64_t footerStart = serializer.BytesWritten();
+			const int32_t magic = PERFTIMER_INDEX_MAGIC;
+			// Versions the footer's own layout - the event format already has its
+			// magic at the head of the file.
+			const int32_t version = 1;
+			const int32_t rangeCount = static_cast<int32_t>(m_indexRanges.size());
+			const int32_t boundaryCount = static_cast<int32_t>(m_indexBoundaries.size());
+#if PERFTIMER_FORMAT_VERSION >= 2
+			const int32_t nameCount = static_cast<int32_t>(m_nextNameId);
+#else
+			const int32_t nameCount = 0;
+#endif
+			serializer.WriteBytes(&magic, sizeof(magic));
+			serializer.WriteBytes(&version, sizeof(version));
+			serializer.WriteBytes(&rangeCount, sizeof(rangeCount));
+			serializer.WriteBytes(&boundaryCount, sizeof(boundaryCount));
+			serializer.WriteBytes(&nameCount, sizeof(nameCount));
+			for (FrameIndexRange const& range : m_indexRanges)
+			{
+				serializer.WriteBytes(&range.frameId, sizeof(range.frameId));
+				serializer.WriteBytes(&range.offset, sizeof(range.offset));
+				serializer.WriteBytes(&range.eventCount, sizeof(range.eventCount));
+			}
+			for (FrameIndexBoundary const& boundary : m_indexBoundaries)
+			{
+				serializer.WriteBytes(&boundary.frameId, sizeof(boundary.frameId));
+				serializer.WriteBytes(&boundary.timestamp, sizeof(boundary.timestamp));
+			}
+#if PERFTIMER_FORMAT_VERSION >= 2
+			std::vector<std::pair<uint16_t, char const*>> names(static_cast<size_t>(nameCount), { 0, nullptr });
+			for (auto const& entry : m_nameIds)
+			{
+				names[entry.second] = { static_cast<uint16_t>(strlen(entry.first)), entry.first };
+			}
+			for (auto const& entry : m_dynamicNameIds)
+			{
+				names[entry.second] = { static_cast<uint16_t>(entry.first.size()), entry.first.c_str() };
+			}
+			for (auto const& name : names)
+			{
+				const uint16_t len = name.first;
+				serializer.WriteBytes(&len, sizeof(len));
+				if (len != 0)
+				{
+					serializer.WriteBytes(name.second, len);
+				}
+			}
+#endif
+			serializer.WriteBytes(&footerStart, sizeof(footerStart));
+			serializer.WriteBytes(&magic, sizeof(magic));
+		}
+#endif
+
+		void WriteEvent(ProfileEvent const* event, EventSerializer& serializer)
+		{
+#if PERFTIMER_CLOCK_TSC
+			// Events hold raw ticks; convert to nanoseconds only now, off the hot path.
+			ProfileEvent converted = *event;
+			converted.timestamp = internal_::TscToNanoseconds(event->timestamp);
+			event = &converted;
+#endif
+#if !PERFTIMER_HITCH_TRIGGER
+			// Hitch builds gather both of these at record time instead: the
+			// boundaries that survive retention here would only describe the frames
+			// around hitches, and the event count would only cover what was kept.
+			++m_frameStatEvents;
+			if (event->eventType == EventType::FRAME_BOUNDARY)
+			{
+				RecordFrameStat(event->timestamp);
+			}
+#endif
+#if !PERFTIMER_AGGREGATE && !PERFTIMER_SHARED_MEMORY
+			TrackFrameIndex(event, serializer);
+#endif
+#if PERFTIMER_FORMAT_VERSION >= 3
+			// The thread id and timestamp base live in chunk records, and the frame id
+			// in frame records, so each event carries only a tag, a 32-bit delta from
+			// the chunk base, and a 16-bit name index - 7 bytes. A new chunk record is
+			// emitted whenever the thread changes or the delta would overflow; with
+			// per-thread buffers the chains are written one thread at a time, so chunk
+			// records stay rare.
+			const int64_t threadId = event->threadId;
+			const int64_t timestamp = event->timestamp;
+			const int32_t frameCount = event->frameCount;
+			if (threadId != m_chunkThreadId || timestamp < m_chunkBaseTimestamp
+				|| timestamp - m_chunkBaseTimestamp > static_cast<int64_t>(UINT32_MAX))
+			{
+				unsigned char tag = 254;
+				serializer.WriteBytes(&tag, sizeof(tag));
+				serializer.WriteBytes(&threadId, sizeof(threadId));
+				serializer.WriteBytes(&timestamp, sizeof(timestamp));
+				m_chunkThreadId = threadId;
+				m_chunkBaseTimestamp = timestamp;
+			}
+			if (frameCount != m_chunkFrameId)
+			{
+				unsigned char tag = 253;
+				serializer.WriteBytes(&tag, sizeof(tag));
+				serializer.WriteBytes(&frameCount, sizeof(frameCount));
+				m_chunkFrameId = frameCount;
+			}
+			const uint32_t internedName = InternName(event->name, serializer);
+			if (internedName > UINT16_MAX && !m_nameIndexOverflowWarned)
+			{
+				// The 16-bit index wraps past this point and events alias earlier
+				// table entries; say so once rather than produce a silently wrong
+				// report.
+				fprintf(stderr, "perf_timer: capture exceeds 65536 distinct names; event names past the limit will be wrong in the report.\n");
+				m_nameIndexOverflowWarned = true;
+			}
+			const uint16_t nameIndex = static_cast<uint16_t>(internedName);
+			const uint32_t delta = static_cast<uint32_t>(timestamp - m_chunkBaseTimestamp);
+			const EventType eventType = event->eventType;
+			serializer.WriteBytes(&eventType, sizeof(eventType));
+			serializer.WriteBytes(&delta, sizeof(delta));
+			serializer.WriteBytes(&nameIndex, sizeof(nameIndex));
+			if (EventCarriesValue(eventType))
+			{
+				const int64_t value = event->value;
+				serializer.WriteBytes(&value, sizeof(value));
+			}
+#elif PERFTIMER_FORMAT_VERSION >= 2
+			uint32_t nameIndex = InternName(event->name, serializer);
+			unsigned char prefix[21];
+			serializer.WriteBytes(prefix, PackEventPrefix(event, prefix));
+			serializer.WriteBytes(&nameIndex, sizeof(nameIndex));
+			if (EventCarriesValue(event->eventType))
+			{
+				const int64_t value = event->value;
+				serializer.WriteBytes(&value, sizeof(value));
+			}
+#else
+#if PERFTIMER_SHARED_MEMORY
+			// pthread_self values are addresses and can collide across processes, so
+			// fold the pid into the high bits of the recorded thread id.
+			ProfileEvent stamped = *event;
+			stamped.threadId ^= static_cast<int64_t>(m_pid) << 32;
+			event = &stamped;
+#endif
+			unsigned char prefix[21];
+			serializer.WriteBytes(prefix, PackEventPrefix(event, prefix));
+			int16_t len = static_cast<int16_t>(strlen(event->name));
+			if (event->name[0] == '\1')
+			{
+				// The marker byte isn't part of the name; the recorded length must
+				// match the bytes actually written or the stream desyncs.
+				--len;
+				serializer.WriteBytes(&len, sizeof(int16_t));
+				serializer.WriteBytes(event->name + 1, len);
+			}
+			else
+			{
+				serializer.WriteBytes(&len, sizeof(int16_t));
+				serializer.WriteBytes(event->name, len);
+			}
+			if (EventCarriesValue(event->eventType))
+			{
+				const int64_t value = event->value;
+				serializer.WriteBytes(&value, sizeof(value));
+			}
+#endif
+		}
+
+#if PERFTIMER_FORMAT_VERSION >= 2
+		// Returns the table index for a name, emitting a name-table record ahead of the
+		// current event the first time a given name is seen. Static names are deduplicated
+		// by pointer; CloneStr'd names by content (their pointers are only stable when
+		// the arena deduplicates).
+		uint32_t InternName(char const* name, EventSerializer& serializer)
+		{
+			if (name[0] == '\1')
+			{
+				std::string key(name + 1);
+				auto found = m_dynamicNameIds.find(key);
+				if (found != m_dynamicNameIds.end())
+				{
+					return found->second;
+				}
+				uint32_t id = m_nextNameId++;
+				WriteNameRecord(key.c_str(), static_cast<uint16_t>(key.size()), serializer);
+				m_dynamicNameIds.emplace(std::move(key), id);
+				return id;
+			}
+			auto found = m_nameIds.find(name);
+			if (found != m_nameIds.end())
+			{
+				return found->second;
+			}
+			uint32_t id = m_nextNameId++;
+			WriteNameRecord(name, static_cast<uint16_t>(strlen(name)), serializer);
+			m_nameIds.emplace(name, id);
+			return id;
+		}
+
+		void WriteNameRecord(char const* name, uint16_t len, EventSerializer& serializer)
+		{
+			// The tag sits where an event type would; 255 can never be a real event type.
+			unsigned char tag = 255;
+			serializer.WriteBytes(&tag, sizeof(tag));
+			serializer.WriteBytes(&len, sizeof(len));
+			serializer.WriteBytes(name, len);
+		}
+#endif
+
+#if !PERFTIMER_BACKEND_LOCKFREE
+		// The pool keeps written-out buffers across capture sessions so the next
+		// Start() reuses warm, already-faulted pages. Callers synchronize access:
+		// the mutex backend holds m_mutex in AddEvent, the thread-buffer backend
+		// takes it at the (rare) buffer-full boundary, and Write() runs quiesced.
+		// Streaming is the exception - the flusher returns buffers while recording
+		// threads draw fresh ones - so there the pool borrows m_flushMutex.
+		ProfileEventBuffer* AcquireBuffer()
+		{
+#if PERFTIMER_POOL_BUFFERS
+#if PERFTIMER_STREAMING
+			std::lock_guard<std::mutex> poolLock(m_flushMutex);
+#endif
+			if (m_bufferPool != nullptr)
+			{
+				ProfileEventBuffer* buffer = m_bufferPool;
+				m_bufferPool = buffer->next;
+				buffer->next = nullptr;
+				buffer->current = buffer->events;
+				return buffer;
+			}
+#endif
+			return NewEventBuffer<ProfileEventBuffer>();
+		}
+
+		void ReleaseBuffer(ProfileEventBuffer* buffer)
+		{
+#if PERFTIMER_POOL_BUFFERS
+#if PERFTIMER_STREAMING
+			std::lock_guard<std::mutex> poolLock(m_flushMutex);
+#endif
+			buffer->current = buffer->events;
+			buffer->next = m_bufferPool;
+			m_bufferPool = buffer;
+#else
+			DeleteEventBuffer(buffer);
+#endif
+		}
+#endif
+
+#if PERFTIMER_THREAD_BUFFERS && !PERFTIMER_STREAMING && !PERFTIMER_FLIGHT_RECORDER
+		// Per-chain variants of the pool above. Popping happens only on the owning
+		// thread at a buffer-full boundary, and pushing only from Write() with
+		// recording quiesced, so neither side needs a lock.
+		ProfileEventBuffer* AcquireChainBuffer(ThreadEventChain* chain)
+		{
+#if PERFTIMER_POOL_BUFFERS
+			if (chain->pool != nullptr)
+			{
+				ProfileEventBuffer* buffer = chain->pool;
+				chain->pool = buffer->next;
+				buffer->next = nullptr;
+				buffer->current = buffer->events;
+				return buffer;
+			}
+#endif
+			return NewEventBuffer<ProfileEventBuffer>();
+		}
+
+		void ReleaseChainBuffer(ThreadEventChain* chain, ProfileEventBuffer* buffer)
+		{
+#if PERFTIMER_POOL_BUFFERS
+			buffer->current = buffer->events;
+			buffer->next = chain->pool;
+			chain->pool = buffer;
+#else
+			DeleteEventBuffer(buffer);
+#endif
+		}
+#endif
+
+#if PERFTIMER_BACKEND_LOCKFREE
+		// Pops can race each other (several threads hitting a buffer-full boundary
+		// at once), but pushes only happen from Write() with recording quiesced, so
+		// the classic ABA hazard of a lock-free stack can't arise here. A thread
+		// that loses the link-in race deletes its spare buffer rather than pushing
+		// it back, which keeps that invariant; the pool refills at the next Write().
+		LockFreeEventBuffer* AcquireLockFreeBuffer()
+		{
+#if PERFTIMER_POOL_BUFFERS
+			LockFreeEventBuffer* buffer = m_lockFreePool.load(std::memory_order_acquire);
+			while (buffer != nullptr)
+			{
+				LockFreeEventBuffer* next = buffer->next.load(std::memory_order_relaxed);
+				if (m_lockFreePool.compare_exchange_weak(buffer, next, std::memory_order_acquire, std::memory_order_acquire))
+				{
+					buffer->next.store(nullptr, std::memory_order_relaxed);
+					buffer->claimed.store(0, std::memory_order_relaxed);
+					buffer->committed.store(0, std::memory_order_release);
+					return buffer;
+				}
+			}
+#endif
+			return NewEventBuffer<LockFreeEventBuffer>();
+		}
+
+		void ReleaseLockFreeBuffer(LockFreeEventBuffer* buffer)
+		{
+#if PERFTIMER_POOL_BUFFERS
+			buffer->next.store(m_lockFreePool.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			m_lockFreePool.store(buffer, std::memory_order_release);
+#else
+			DeleteEventBuffer(buffer);
+#endif
+		}
+#endif
+
+#if !PERFTIMER_BACKEND_LOCKFREE
+		void WriteBufferChain(ProfileEventBuffer* buffer, EventSerializer& serializer)
+		{
+			while (buffer != nullptr)
+			{
+				ProfileEvent* event = buffer->events;
+				while (event < buffer->current)
+				{
+					WriteEvent(event, serializer);
+					++event;
+				}
+				ProfileEventBuffer* oldBuffer = buffer;
+				buffer = buffer->next;
+				ReleaseBuffer(oldBuffer);
+			}
+		}
+#endif
+
+#if PERFTIMER_THREAD_BUFFERS && !PERFTIMER_STREAMING && !PERFTIMER_FLIGHT_RECORDER
+		// As above, but retires the drained buffers into the owning chain's pool
+		// instead of the recorder-wide one.
+		void WriteBufferChain(ProfileEventBuffer* buffer, EventSerializer& serializer, ThreadEventChain* chain)
+		{
+			while (buffer != nullptr)
+			{
+				ProfileEvent* event = buffer->events;
+				while (event < buffer->current)
+				{
+					WriteEvent(event, serializer);
+					++event;
+				}
+				ProfileEventBuffer* oldBuffer = buffer;
+				buffer = buffer->next;
+				ReleaseChainBuffer(chain, oldBuffer);
+			}
+		}
+#endif
+
+#if !PERFTIMER_STREAMING && !PERFTIMER_THREAD_BUFFERS && !PERFTIMER_BACKEND_LOCKFREE && !PERFTIMER_AGGREGATE && !PERFTIMER_FLIGHT_RECORDER && !PERFTIMER_HITCH_TRIGGER && !PERFTIMER_SHARED_MEMORY
+		// The tail of Checkpoint(): serializes the chain it detached under the
+		// recorder lock. Runs without that lock - recording continues into the
+		// fresh chain - and only retakes it briefly, to snapshot the name table
+		// and to return the drained buffers to the pool.
+		void WriteDetached(ProfileEventBuffer* first, int32_t count, std::string const& filename)
+		{
+#ifdef _MSC_VER
+			FILE* output;
+			fopen_s(&output, filename.c_str(), PERFTIMER_FILE_MODE);
+#else
+			FILE* output = fopen(filename.c_str(), PERFTIMER_FILE_MODE);
+#endif
+			if (output == nullptr)
+			{
+				// The events are already detached and lost to this segment either
+				// way; at least their buffers get returned below.
+				perror("Could not open perf_timer checkpoint file for writing.");
+			}
+			else
+			{
+				// WriteThreadNames() would walk the live table unlocked; snapshot
+				// it instead, so a thread registering a name mid-checkpoint can't
+				// desync the table from the count already written to the header.
+				std::unordered_map<int64_t, std::string> names;
+				{
+#if PERFTIMER_MULTITHREADED
+					std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+					names = m_threadNames;
+				}
+				count += static_cast<int32_t>(names.size());
+				WriteFileHeader(output, count);
+				EventSerializer serializer(output);
+				ResetFrameIndex();
+				for (auto const& entry : names)
+				{
+					ProfileEvent event{ EventType::THREAD_NAME, entry.first, -1, 0, entry.second.c_str() };
+					WriteEvent(&event, serializer);
+				}
+				for (ProfileEventBuffer* buffer = first; buffer != nullptr; buffer = buffer->next)
+				{
+					for (ProfileEvent* event = buffer->events; event < buffer->current; ++event)
+					{
+						WriteEvent(event, serializer);
+					}
+				}
+				WriteFrameIndex(serializer);
+				serializer.Flush();
+				fflush(output);
+				fclose(output);
+			}
+#if PERFTIMER_FORMAT_VERSION >= 2
+			// Write() assumes this state is clean from BeginCapture(); leave it
+			// that way for the next checkpoint or the final capture file.
+			m_nameIds.clear();
+			m_dynamicNameIds.clear();
+			m_nextNameId = 0;
+#endif
+#if PERFTIMER_FORMAT_VERSION >= 3
+			m_chunkThreadId = INT64_MIN;
+			m_chunkFrameId = INT32_MIN;
+#endif
+			{
+#if PERFTIMER_MULTITHREADED
+				std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+				while (first != nullptr)
+				{
+					ProfileEventBuffer* next = first->next;
+					ReleaseBuffer(first);
+					first = next;
+				}
+			}
+		}
+#endif
+
+#if PERFTIMER_HITCH_TRIGGER
+		// Called at each frame boundary, holding m_mutex in multithreaded builds:
+		// judges the frame that just ended and either splices its staged buffers
+		// onto the retained chain - preceded by the rolling window, so the run-up
+		// to the hitch is kept too - or rotates it into the window, recycling the
+		// oldest unhitched frame's buffers through the pool.
+		void CloseHitchFrame(int64_t timestamp)
+		{
+#if PERFTIMER_CLOCK_TSC
+			const int64_t ns = internal_::TscToNanoseconds(timestamp);
 #else
-#	define PERF_TIMER(frameId)
-#	define PERF_NOTE(name, frameId)
+			const int64_t ns = timestamp;
 #endif
+			// Every frame is measured here whether or not it is retained, so the
+			// statistics End() prints cover the whole run, not just the hitches.
+			// m_framePrevTimestamp is the previous boundary, which is exactly the
+			// start of the frame being judged.
+			const int64_t durationNs = m_frameStatCount > 0 ? ns - m_framePrevTimestamp : -1;
+			RecordFrameStat(ns);
+			if (m_stageFirst == nullptr)
+			{
+				return;
+			}
+			const HitchFrame frame{ m_stageFirst, m_stageCurrent, m_stageCount };
+			m_stageFirst = nullptr;
+			m_stageCurrent = nullptr;
+			m_stageCount = 0;
+			if (durationNs > PERFTIMER_HITCH_BUDGET_NS)
+			{
+				for (int i = 0; i < m_hitchWindowSize; ++i)
+				{
+					RetainHitchFrame(m_hitchWindow[i]);
+				}
+				m_hitchWindowSize = 0;
+				RetainHitchFrame(frame);
+				return;
+			}
+			if (m_hitchWindowSize == PERFTIMER_HITCH_WINDOW)
+			{
+				ReleaseHitchFrame(m_hitchWindow[0]);
+				for (int i = 1; i < m_hitchWindowSize; ++i)
+				{
+					m_hitchWindow[i - 1] = m_hitchWindow[i];
+				}
+				--m_hitchWindowSize;
+			}
+			m_hitchWindow[m_hitchWindowSize] = frame;
+			++m_hitchWindowSize;
+		}
 
-namespace PerfTimer
-{
-	enum class EventType : unsigned char
-	{
-		ENTER_CONTEXT = 0,
-		EXIT_CONTEXT = 1,
-		NOTE = 2
-	};
+		void RetainHitchFrame(HitchFrame const& frame)
+		{
+			if (m_first == nullptr)
+			{
+				m_first = frame.first;
+			}
+			else
+			{
+				m_current->next = frame.first;
+			}
+			m_current = frame.last;
+			m_count += frame.count;
+		}
 
-	PERFTIMER_PACK(
-		struct ProfileEvent
+		void ReleaseHitchFrame(HitchFrame const& frame)
 		{
-			EventType eventType;
-			int64_t threadId;
-			int32_t frameCount;
-			int64_t timestamp;
-			char const* name{ nullptr };
+			ProfileEventBuffer* buffer = frame.first;
+			while (buffer != nullptr)
+			{
+				ProfileEventBuffer* next = buffer->next;
+				ReleaseBuffer(buffer);
+				buffer = next;
+			}
 		}
-	);
 
-	struct ProfileEventBuffer
-	{
-		ProfileEvent events[PERFTIMER_BUFFER_SIZE]{};
-		ProfileEvent* current{ events };
-		ProfileEventBuffer* next{ nullptr };
-	};
+		// Frames still awaiting judgement when the capture ends either never
+		// hitched (the window) or have no closing boundary to be judged by (the
+		// partial frame being staged); both are dropped.
+		void DiscardPendingHitchFrames()
+		{
+			for (int i = 0; i < m_hitchWindowSize; ++i)
+			{
+				ReleaseHitchFrame(m_hitchWindow[i]);
+			}
+			m_hitchWindowSize = 0;
+			if (m_stageFirst != nullptr)
+			{
+				ReleaseHitchFrame(HitchFrame{ m_stageFirst, m_stageCurrent, m_stageCount });
+				m_stageFirst = nullptr;
+				m_stageCurrent = nullptr;
+				m_stageCount = 0;
+			}
+		}
+#endif
 
-	inline char const* CloneStr(char const* str)
-	{
-		size_t size = strlen(str);
-		char* ret = reinterpret_cast<char*>(malloc(size + 1));
-		if (ret == nullptr)
+#if PERFTIMER_THREAD_BUFFERS
+		ThreadEventChain* RegisterThreadChain()
 		{
-			throw std::runtime_error("Out of memory");
+			ThreadEventChain* chain = new ThreadEventChain();
+			std::lock_guard<std::mutex> lock(m_mutex);
+			chain->nextChain = m_chains;
+			m_chains = chain;
+			return chain;
 		}
-		ret[0] = '\1';
-		memcpy(ret + 1, str, size);
-		return ret;
-	}
+#endif
 
-	class EventRecorder
-	{
-	public:
-		~EventRecorder()
+#if PERFTIMER_AGGREGATE
+#if PERFTIMER_MULTITHREADED
+		AggregateThreadState* RegisterAggregateState()
 		{
-			Write();
+			AggregateThreadState* state = new AggregateThreadState();
+#ifdef _MSC_VER
+			state->threadId = static_cast<int64_t>(GetCurrentThreadId());
+#else
+			state->threadId = static_cast<int64_t>(pthread_self());
+#endif
+			std::lock_guard<std::mutex> lock(m_mutex);
+			state->nextState = m_aggregateStates;
+			m_aggregateStates = state;
+			return state;
 		}
+#endif
 
-		void AddEvent(ProfileEvent&& event)
+		// Looks up (or creates) the state recording under the given id; async
+		// contexts and single-threaded builds land here instead of going through
+		// a thread_local. The walk is linear, which is fine as long as context
+		// ids come from a small reused pool - the same property that keeps the
+		// summary readable.
+		AggregateThreadState* FindAggregateState(int64_t threadId)
 		{
-			if (!m_enabled)
+#if PERFTIMER_MULTITHREADED
+			std::lock_guard<std::mutex> lock(m_mutex);
+#endif
+			for (AggregateThreadState* state = m_aggregateStates; state != nullptr; state = state->nextState)
 			{
-				return;
+				if (state->threadId == threadId)
+				{
+					return state;
+				}
+			}
+			AggregateThreadState* state = new AggregateThreadState();
+			state->threadId = threadId;
+			state->nextState = m_aggregateStates;
+			m_aggregateStates = state;
+			return state;
+		}
+
+		// Folds one event into the recording thread's tree instead of storing it.
+		// An enter pushes an open scope; the matching exit pops it and adds the
+		// scope's inclusive and exclusive time to its node, scaled by the sample
+		// rate for sampled scopes (min/max stay per-observation, mirroring the
+		// viewer's treatment of sampled data). Counters keep min/max/mean per
+		// name. Notes annotate individual moments and a summary has nowhere to
+		// put them, so they only count toward the events-per-frame statistic.
+		void AggregateEvent(ProfileEvent const& event)
+		{
+			AggregateThreadState* state;
+			if ((event.threadId & ASYNC_CONTEXT_BIT) != 0)
+			{
+				// An async context's events can arrive under any worker thread, so
+				// they fold into a state keyed by the context id rather than a
+				// thread_local one. A context never runs on two threads at once,
+				// so once found the state needs no lock of its own.
+				state = FindAggregateState(event.threadId);
 			}
+			else
+			{
 #if PERFTIMER_MULTITHREADED
-			std::lock_guard<std::mutex> lock(m_mutex);
+				// The state object is owned by the recorder (it has to outlive the thread
+				// so Write() can still reach the totals), so the thread_local is only a
+				// pointer; after registration a thread touches nothing shared.
+				static thread_local AggregateThreadState* threadState = RegisterAggregateState();
+				state = threadState;
+#else
+				state = FindAggregateState(event.threadId);
 #endif
-			*m_current->current = event;
-			++m_current->current;
-			if (m_current->current >= (m_current->events + 32768))
+			}
+			++state->eventCount;
+			switch (event.eventType)
 			{
-				ProfileEventBuffer* newBuffer = new ProfileEventBuffer();
-				m_current->next = newBuffer;
-				m_current = newBuffer;
+			case EventType::ENTER_CONTEXT:
+			case EventType::SAMPLED_ENTER:
+			{
+				AggregateNode* parent = state->stack.empty() ? &state->root : state->stack.back().node;
+				AggregateNode*& child = parent->children[event.name];
+				if (child == nullptr)
+				{
+					child = new AggregateNode();
+					child->name = event.name;
+				}
+				const int64_t weight = event.eventType == EventType::SAMPLED_ENTER ? event.value : 1;
+				state->stack.push_back({ child, event.timestamp, 0, weight });
+				break;
+			}
+			case EventType::EXIT_CONTEXT:
+			{
+				if (state->stack.empty())
+				{
+					// An exit whose enter predates Start(); there is nothing to close.
+					break;
+				}
+				const AggregateOpenScope scope = state->stack.back();
+				state->stack.pop_back();
+				const int64_t inclusive = event.timestamp - scope.enterTimestamp;
+				int64_t exclusive = inclusive - scope.childTime;
+				if (exclusive < 0)
+				{
+					exclusive = 0;
+				}
+				AggregateNode* node = scope.node;
+				node->count += scope.weight;
+				node->inclusive += inclusive * scope.weight;
+				node->exclusive += exclusive * scope.weight;
+				if (inclusive < node->minInclusive)
+				{
+					node->minInclusive = inclusive;
+				}
+				if (inclusive > node->maxInclusive)
+				{
+					node->maxInclusive = inclusive;
+				}
+				if (!state->stack.empty())
+				{
+					state->stack.back().childTime += inclusive;
+				}
+				break;
+			}
+			case EventType::COUNTER:
+			case EventType::COUNTER_FLOAT:
+			{
+				double value;
+				if (event.eventType == EventType::COUNTER_FLOAT)
+				{
+					memcpy(&value, &event.value, sizeof(value));
+				}
+				else
+				{
+					value = double(event.value);
+				}
+				AggregateCounter& counter = state->counters[event.name];
+				if (counter.count == 0 || value < counter.minValue)
+				{
+					counter.minValue = value;
+				}
+				if (counter.count == 0 || value > counter.maxValue)
+				{
+					counter.maxValue = value;
+				}
+				counter.totalValue += value;
+				++counter.count;
+				break;
+			}
+			case EventType::FRAME_BOUNDARY:
+				// Frame marks come from the one thread driving the frame loop, so
+				// feeding the shared statistics directly at record time is safe.
+#if PERFTIMER_CLOCK_TSC
+				RecordFrameStat(internal_::TscToNanoseconds(event.timestamp));
+#else
+				RecordFrameStat(event.timestamp);
+#endif
+				break;
+			case EventType::NOTE:
+				break;
+			case EventType::THREAD_NAME:
+				// Never recorded as an event in this backend; SetThreadName()'s
+				// table feeds the summary's thread column directly.
+				break;
 			}
-			++m_count;
 		}
 
-		static EventRecorder& get()
+		// Converts an aggregated duration to milliseconds; under the TSC clock
+		// the totals are in raw ticks and are only scaled here, off the hot path.
+		static double DurationMs(int64_t duration)
 		{
-			static EventRecorder recorder;
-			return recorder;
+#if PERFTIMER_CLOCK_TSC
+			return double(duration) * internal_::TscCalibration<>::value.nsPerTick / 1e6;
+#else
+			return double(duration) / 1e6;
+#endif
 		}
 
-		static void Start(std::string const& filename)
+		// Dynamic names carry the arena's marker byte so the serializers know to
+		// intern them; the summary just prints the text behind it.
+		static char const* PrintableName(char const* name)
 		{
-			EventRecorder& recorder = EventRecorder::get();
-			recorder.m_filename = filename;
-			recorder.m_enabled = true;
-			recorder.m_first = new ProfileEventBuffer();
-			recorder.m_current = recorder.m_first;
+			return name[0] == '\1' ? name + 1 : name;
 		}
 
-		static void End()
+		// The summary's thread column: the registered name when the thread has
+		// one, otherwise the raw id.
+		std::string ThreadLabel(int64_t threadId)
 		{
-			EventRecorder& recorder = EventRecorder::get();
-			recorder.m_enabled = false;
-			recorder.Write();
-			recorder.m_count = 0;
+			auto found = m_threadNames.find(threadId);
+			if (found != m_threadNames.end())
+			{
+				return found->second;
+			}
+			if ((threadId & ASYNC_CONTEXT_BIT) != 0)
+			{
+				return "async:" + std::to_string(threadId & ~ASYNC_CONTEXT_BIT);
+			}
+			return std::to_string(threadId);
 		}
 
-		void Write()
+		void WriteAggregateNode(FILE* output, std::string const& threadLabel, AggregateNode const* node, std::string const& parentPath)
+		{
+			std::string path = parentPath.empty()
+				? std::string(PrintableName(node->name))
+				: parentPath + "::" + PrintableName(node->name);
+			fprintf(output, "scope\t%s\t%s\t%lld\t%.3f\t%.3f\t%.3f\t%.3f\n",
+				threadLabel.c_str(), path.c_str(),
+				static_cast<long long>(node->count),
+				DurationMs(node->inclusive), DurationMs(node->exclusive),
+				DurationMs(node->minInclusive == INT64_MAX ? 0 : node->minInclusive),
+				DurationMs(node->maxInclusive));
+			for (auto const& child : node->children)
+			{
+				WriteAggregateNode(output, threadLabel, child.second, path);
+			}
+		}
+
+		// Emits the summary: one tab-separated line per distinct call stack per
+		// thread, then one per counter name per thread, and resets the trees so
+		// the state objects (still referenced by thread_locals) are clean for the
+		// next session. Scopes still open when the capture ends never folded into
+		// their node and are simply absent, just as an unexited scope never
+		// reaches the event stream backends.
+		void WriteAggregate()
 		{
-			if (m_count == 0)
+			// Nothing recorded since the last write - this is the destructor running
+			// after End() already wrote the summary. Opening the file again here
+			// would truncate it.
+			int64_t recorded = 0;
+			for (AggregateThreadState* state = m_aggregateStates; state != nullptr; state = state->nextState)
+			{
+				recorded += state->eventCount;
+			}
+			if (recorded == 0)
 			{
 				return;
 			}
 #ifdef _MSC_VER
 			FILE* output;
-			fopen_s(&output, m_filename.c_str(), "wb");
+			fopen_s(&output, m_filename.c_str(), "w");
 #else
-			FILE* output = fopen(m_filename.c_str(), "wb");
+			FILE* output = fopen(m_filename.c_str(), "w");
 #endif
 			if (output == nullptr)
 			{
 				perror("Could not open perf_timer output file for writing.");
 				return;
 			}
-			int32_t magic = 0xFA57;
-			fwrite(&magic, sizeof(magic), 1, output);
-			fwrite(&m_count, sizeof(m_count), 1, output);
-			ProfileEventBuffer* buffer = m_first;
-			while (buffer != nullptr)
+			fprintf(output, "# perf_timer aggregate summary\n");
+			fprintf(output, "# scope\tthread\tstack\tcalls\tinclusive_ms\texclusive_ms\tmin_inclusive_ms\tmax_inclusive_ms\n");
+			fprintf(output, "# counter\tthread\tname\tsamples\tmin\tmax\tmean\n");
+			for (AggregateThreadState* state = m_aggregateStates; state != nullptr; state = state->nextState)
 			{
-				ProfileEvent* event = buffer->events;
-				while (event < buffer->current)
+				const std::string threadLabel = ThreadLabel(state->threadId);
+				for (auto const& child : state->root.children)
 				{
-					fwrite(event, sizeof(EventType) + sizeof(int64_t) + sizeof(int32_t) + sizeof(int64_t), 1, output);
-					int16_t len = static_cast<int16_t>(strlen(event->name));
-					fwrite(&len, sizeof(int16_t), 1, output);
-					if (event->name[0] == '\1')
-					{
-						fwrite(event->name + 1, len - 1, 1, output);
-						free(reinterpret_cast<void*>(const_cast<char*>(event->name)));
-					}
-					else
-					{
-						fwrite(event->name, len, 1, output);
-					}
-					++event;
+					WriteAggregateNode(output, threadLabel, child.second, std::string());
 				}
-				ProfileEventBuffer* oldBuffer = buffer;
-				buffer = buffer->next;
-				delete oldBuffer;
+				for (auto const& entry : state->counters)
+				{
+					AggregateCounter const& counter = entry.second;
+					fprintf(output, "counter\t%s\t%s\t%lld\t%g\t%g\t%g\n",
+						threadLabel.c_str(), PrintableName(entry.first),
+						static_cast<long long>(counter.count),
+						counter.minValue, counter.maxValue,
+						counter.totalValue / double(counter.count));
+				}
+				m_frameStatEvents += state->eventCount;
+				for (auto& child : state->root.children)
+				{
+					delete child.second;
+				}
+				state->root.children.clear();
+				state->counters.clear();
+				state->stack.clear();
+				state->eventCount = 0;
 			}
 			fflush(output);
 			fclose(output);
 		}
-
-	private:
+#endif
 
 #if PERFTIMER_MULTITHREADED
 		std::mutex m_mutex;
 #endif
 		std::string m_filename;
+		// Names registered through SetThreadName(), keyed by the same id the
+		// events carry. Filled once per thread and kept across sessions.
+		std::unordered_map<int64_t, std::string> m_threadNames;
+#if PERFTIMER_THREAD_BUFFERS
+		ThreadEventChain* m_chains{ nullptr };
+#elif PERFTIMER_BACKEND_LOCKFREE
+		LockFreeEventBuffer* m_first{ nullptr };
+		std::atomic<LockFreeEventBuffer*> m_current{ nullptr };
+#elif PERFTIMER_AGGREGATE
+		AggregateThreadState* m_aggregateStates{ nullptr };
+#else
 		ProfileEventBuffer* m_first{ nullptr };
 		ProfileEventBuffer* m_current{ nullptr };
+#if PERFTIMER_FLIGHT_RECORDER
+		bool m_wrapped{ false };
+#endif
+#if PERFTIMER_HITCH_TRIGGER
+		// The frame being recorded stages into its own chain; closed frames park
+		// in the rolling window until a hitch retains them or age discards them.
+		ProfileEventBuffer* m_stageFirst{ nullptr };
+		ProfileEventBuffer* m_stageCurrent{ nullptr };
+		int m_stageCount{ 0 };
+		HitchFrame m_hitchWindow[PERFTIMER_HITCH_WINDOW];
+		int m_hitchWindowSize{ 0 };
+#endif
+#endif
+#if PERFTIMER_POOL_BUFFERS
+#if PERFTIMER_BACKEND_LOCKFREE
+		std::atomic<LockFreeEventBuffer*> m_lockFreePool{ nullptr };
+#else
+		ProfileEventBuffer* m_bufferPool{ nullptr };
+#endif
+#endif
+#if PERFTIMER_FORMAT_VERSION >= 2
+		std::unordered_map<char const*, uint32_t> m_nameIds;
+		std::unordered_map<std::string, uint32_t> m_dynamicNameIds;
+		uint32_t m_nextNameId{ 0 };
+#endif
+#if PERFTIMER_FORMAT_VERSION >= 3
+		// Cursors for the chunked v3 encoding; the sentinels force a chunk record
+		// and a frame record ahead of the first event of each file.
+		int64_t m_chunkThreadId{ INT64_MIN };
+		int64_t m_chunkBaseTimestamp{ 0 };
+		int32_t m_chunkFrameId{ INT32_MIN };
+		// Never reset: one warning per process is enough even across checkpoints.
+		bool m_nameIndexOverflowWarned{ false };
+#endif
+#if !PERFTIMER_AGGREGATE && !PERFTIMER_SHARED_MEMORY
+		// Frame index accumulated as events pass the serializer and appended as
+		// the file's footer; see WriteFrameIndex.
+		std::vector<FrameIndexRange> m_indexRanges;
+		std::vector<FrameIndexBoundary> m_indexBoundaries;
+		int32_t m_indexFrameId{ INT32_MIN };
+		int64_t m_indexRangeStart{ 0 };
+		int32_t m_indexRangeEvents{ 0 };
+#endif
+#if PERFTIMER_STREAMING
+		FILE* m_output{ nullptr };
+		EventSerializer* m_serializer{ nullptr };
+		std::mutex m_flushMutex;
+		std::condition_variable m_flushCondition;
+		std::thread m_flushThread;
+		ProfileEventBuffer* m_readyFirst{ nullptr };
+		ProfileEventBuffer* m_readyLast{ nullptr };
+		bool m_flushExit{ false };
+		// Non-empty when a Checkpoint() is pending; guarded by m_flushMutex and
+		// consumed by the flusher once it has drained the queue ahead of it.
+		std::string m_rotateTo;
+#if PERFTIMER_STREAM_QUEUE_LIMIT
+		int m_readyCount{ 0 };
+		int m_droppedBuffers{ 0 };
+#endif
+#if PERFTIMER_SOCKET
+		bool m_outputIsSocket{ false };
+#endif
+#endif
+#if PERFTIMER_CRASH_DUMP
+		int m_crashFd{ -1 };
+#endif
+#if PERFTIMER_SHARED_MEMORY
+		char* m_shm{ nullptr };
+		int32_t m_pid{ 0 };
+#endif
+		std::atomic<int32_t> m_frameCounter{ -1 };
+		// Frame statistics gathered during Write(); see RecordFrameStat().
+		int m_frameStatCount{ 0 };
+		int m_frameIntervals{ 0 };
+		int64_t m_frameStatEvents{ 0 };
+		int64_t m_framePrevTimestamp{ 0 };
+		int64_t m_frameMinNs{ INT64_MAX };
+		int64_t m_frameMaxNs{ 0 };
+		int64_t m_frameTotalNs{ 0 };
 		int m_count{ 0 };
 		bool m_enabled{ false };
 	};
@@ -279,20 +4022,31 @@ namespace PerfTimer
 #elif defined(__GNUC__) || defined(__clang__)
 	inline int64_t Now()
 	{
+#if PERFTIMER_CLOCK_TSC
+		return static_cast<int64_t>(__rdtsc());
+#else
 		struct timespec ts;
 		clock_gettime(CLOCK_REALTIME, &ts);
 		int64_t nanosecondResult = ts.tv_sec;
 		nanosecondResult *= 1000000000;
 		nanosecondResult += ts.tv_nsec;
 		return nanosecondResult;
+#endif
 	}
 #endif
 
+	// Maps the FRAME_AUTO default to the recorder's frame counter; an explicit
+	// frame id passes through untouched.
+	inline int32_t ResolveFrame(int32_t frameCount)
+	{
+		return frameCount == FRAME_AUTO ? EventRecorder::CurrentFrame() : frameCount;
+	}
+
 	struct PerfTimer
 	{
-		PerfTimer(char const* const name, int32_t frameCount)
+		PerfTimer(char const* const name, int32_t frameCount = FRAME_AUTO)
 			: m_name(name)
-			, m_frameCount(frameCount)
+			, m_frameCount(ResolveFrame(frameCount))
 		{
 #if PERFTIMER_MULTITHREADED
 #	ifdef _MSC_VER
@@ -324,8 +4078,61 @@ namespace PerfTimer
 		int32_t m_frameCount;
 	};
 
-	inline void PerfNote(char const* const name, int32_t frameCount)
+	// Scope timer that records only every Nth invocation per thread. The call
+	// site owns the tick counter (PERF_TIMER_SAMPLED declares a thread_local one),
+	// so the skip path is an increment, a modulo and a branch - no recorder state
+	// is touched at all. Recorded enters carry the rate in the value field so the
+	// viewer can scale inclusive/exclusive times and counts back up.
+	struct SampledPerfTimer
+	{
+		SampledPerfTimer(char const* const name, uint32_t tick, uint32_t rate, int32_t frameCount = FRAME_AUTO)
+			: m_name(name)
+			, m_frameCount(FRAME_AUTO)
+			, m_record(rate <= 1 || tick % rate == 0)
+		{
+			if (!m_record)
+			{
+				return;
+			}
+			m_frameCount = ResolveFrame(frameCount);
+#if PERFTIMER_MULTITHREADED
+#	ifdef _MSC_VER
+			const int64_t threadId = static_cast<int64_t>(GetCurrentThreadId());
+#	else
+			const int64_t threadId = static_cast<int64_t>(pthread_self());
+#	endif
+#else
+			const int64_t threadId = 0;
+#endif
+			EventRecorder::get().AddEvent({ EventType::SAMPLED_ENTER, threadId, m_frameCount, Now(), m_name, static_cast<int64_t>(rate) });
+		}
+
+		~SampledPerfTimer()
+		{
+			if (!m_record)
+			{
+				return;
+			}
+#if PERFTIMER_MULTITHREADED
+#	ifdef _MSC_VER
+			const int64_t threadId = static_cast<int64_t>(GetCurrentThreadId());
+#	else
+			const int64_t threadId = static_cast<int64_t>(pthread_self());
+#	endif
+#else
+			const int64_t threadId = 0;
+#endif
+			EventRecorder::get().AddEvent({ EventType::EXIT_CONTEXT, threadId, m_frameCount, Now(), m_name });
+		}
+
+		char const* const m_name;
+		int32_t m_frameCount;
+		const bool m_record;
+	};
+
+	inline void PerfNote(char const* const name, int32_t frameCount = FRAME_AUTO)
 	{
+		frameCount = ResolveFrame(frameCount);
 #if PERFTIMER_MULTITHREADED
 #	ifdef _MSC_VER
 		const int64_t threadId = static_cast<int64_t>(GetCurrentThreadId());
@@ -337,4 +4144,92 @@ namespace PerfTimer
 #endif
 		EventRecorder::get().AddEvent({ EventType::NOTE, threadId, frameCount, Now(), name });
 	}
+
+	inline void PerfCounterValue(EventType eventType, char const* const name, int64_t value, int32_t frameCount = FRAME_AUTO)
+	{
+		frameCount = ResolveFrame(frameCount);
+#if PERFTIMER_MULTITHREADED
+#	ifdef _MSC_VER
+		const int64_t threadId = static_cast<int64_t>(GetCurrentThreadId());
+#	else
+		const int64_t threadId = static_cast<int64_t>(pthread_self());
+#	endif
+#else
+		const int64_t threadId = 0;
+#endif
+		EventRecorder::get().AddEvent({ eventType, threadId, frameCount, Now(), name, value });
+	}
+
+	// Integral values record as COUNTER; the double overload records as
+	// COUNTER_FLOAT, carrying the bit pattern in the value field. (A template for
+	// the integral case rather than a plain int64_t overload, so that an int
+	// argument isn't ambiguous between the integer and double conversions.)
+	template<typename T>
+	inline void PerfCounter(char const* const name, T value, int32_t frameCount = FRAME_AUTO)
+	{
+		PerfCounterValue(EventType::COUNTER, name, static_cast<int64_t>(value), frameCount);
+	}
+
+	inline void PerfCounter(char const* const name, double value, int32_t frameCount = FRAME_AUTO)
+	{
+		int64_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		PerfCounterValue(EventType::COUNTER_FLOAT, name, bits, frameCount);
+	}
+
+	inline void PerfCounter(char const* const name, float value, int32_t frameCount = FRAME_AUTO)
+	{
+		PerfCounter(name, static_cast<double>(value), frameCount);
+	}
+
+	// Explicit begin/end scope for work that migrates between threads while
+	// open - a fiber or coroutine parked on one worker and resumed on another.
+	// RAII timers key their call stacks by thread id, so a scope that exits on
+	// a different thread than it entered produces mismatched stacks; these
+	// record under the caller's context id (tagged with ASYNC_CONTEXT_BIT)
+	// instead, and the viewer stitches each context's scopes by that id. Begins
+	// and ends nest per context exactly like ordinary scopes. A context must
+	// never run on two threads at once - true by construction for a fiber - and
+	// ids should come from a small reused pool (a fiber index, not a task
+	// serial number) so each context accumulates enough scopes to report on.
+	inline void PerfAsyncBegin(int64_t contextId, char const* const name, int32_t frameCount = FRAME_AUTO)
+	{
+		EventRecorder::get().AddEvent({ EventType::ENTER_CONTEXT, contextId | ASYNC_CONTEXT_BIT, ResolveFrame(frameCount), Now(), name });
+	}
+
+	inline void PerfAsyncEnd(int64_t contextId, char const* const name, int32_t frameCount = FRAME_AUTO)
+	{
+		EventRecorder::get().AddEvent({ EventType::EXIT_CONTEXT, contextId | ASYNC_CONTEXT_BIT, ResolveFrame(frameCount), Now(), name });
+	}
+
+	// Category-tagged timer. The enabled flag is resolved at compile time from
+	// PERFTIMER_ENABLED_CATEGORIES, so the disabled specialization is an empty
+	// struct with an empty constructor - a disabled category leaves no code behind.
+	template<bool enabled>
+	struct CategoryPerfTimer : PerfTimer
+	{
+		CategoryPerfTimer(char const* const name, int32_t frameCount = FRAME_AUTO)
+			: PerfTimer(name, frameCount)
+		{
+		}
+	};
+
+	template<>
+	struct CategoryPerfTimer<false>
+	{
+		CategoryPerfTimer(char const* const, int32_t = FRAME_AUTO)
+		{
+		}
+	};
+
+	template<bool enabled>
+	inline void PerfNoteCat(char const* const name, int32_t frameCount = FRAME_AUTO)
+	{
+		PerfNote(name, frameCount);
+	}
+
+	template<>
+	inline void PerfNoteCat<false>(char const* const, int32_t)
+	{
+	}
 }
\ No newline at end of file
@@ -0,0 +1,213 @@
+// Benchmark suite for the C++ PerfTimer reference implementation.
+//
+// Measures the per-event cost of PerfTimer construction/destruction and of
+// EventRecorder::AddEvent across thread counts, plus Write() throughput in
+// events per second. Build the variants through the Makefile in this directory
+// (single-threaded, mutex, thread buffers, lock-free) and compare:
+//
+//     make run
+//
+// To catch regressions, record a baseline on a quiet machine and compare
+// later runs against it:
+//
+//     ./perf_timer_bench_mt --write-baseline baseline_mt.txt
+//     ./perf_timer_bench_mt --baseline baseline_mt.txt
+//
+// A run exits nonzero and prints a REGRESSION line for any result more than
+// 25% worse than its baseline entry.
+
+#include "../PerfTimer.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if PERFTIMER_MULTITHREADED
+#include <thread>
+#endif
+
+namespace
+{
+	// Total scope pairs per measurement, divided among the worker threads so
+	// memory use stays flat as the thread count grows.
+	constexpr int64_t TOTAL_SCOPE_PAIRS = 1 * 1000 * 1000;
+
+	// Events recorded for the Write() throughput measurement.
+	constexpr int64_t WRITE_EVENT_COUNT = 4 * 1000 * 1000;
+
+	// A result more than this factor worse than its baseline is a regression.
+	constexpr double REGRESSION_FACTOR = 1.25;
+
+	constexpr char const* SCRATCH_FILE = "perf_timer_bench_scratch.bin";
+
+	struct BenchResult
+	{
+		char name[64];
+		double value;
+		bool higherIsBetter;
+	};
+
+	std::vector<BenchResult>& Results()
+	{
+		static std::vector<BenchResult> results;
+		return results;
+	}
+
+	void Record(char const* const name, double value, bool higherIsBetter)
+	{
+		BenchResult result;
+		snprintf(result.name, sizeof(result.name), "%s", name);
+		result.value = value;
+		result.higherIsBetter = higherIsBetter;
+		Results().push_back(result);
+		printf("%-40s %12.2f %s\n", name, value, higherIsBetter ? "events/sec" : "ns/event");
+	}
+
+	void RunScopePairs(int64_t pairs)
+	{
+		for (int64_t i = 0; i < pairs; ++i)
+		{
+			::PerfTimer::PerfTimer timer("bench_scope", -1);
+		}
+	}
+
+	void RunAddEvents(int64_t count)
+	{
+		for (int64_t i = 0; i < count; ++i)
+		{
+			::PerfTimer::EventRecorder::get().AddEvent({ ::PerfTimer::EventType::NOTE, 0, -1, ::PerfTimer::Now(), "bench_note" });
+		}
+	}
+
+	// Runs fn(perThread) on threadCount threads (or inline when the build is
+	// single-threaded) and returns the elapsed wall time in nanoseconds.
+	int64_t TimeThreads(int threadCount, int64_t perThread, void (*fn)(int64_t))
+	{
+		const int64_t start = ::PerfTimer::Now();
+#if PERFTIMER_MULTITHREADED
+		std::vector<std::thread> workers;
+		workers.reserve(threadCount);
+		for (int i = 0; i < threadCount; ++i)
+		{
+			workers.emplace_back(fn, perThread);
+		}
+		for (auto& worker : workers)
+		{
+			worker.join();
+		}
+#else
+		(void)threadCount;
+		fn(perThread);
+#endif
+		return ::PerfTimer::Now() - start;
+	}
+
+	void BenchThreadCount(int threadCount)
+	{
+		char name[64];
+		const int64_t pairsPerThread = TOTAL_SCOPE_PAIRS / threadCount;
+
+		::PerfTimer::EventRecorder::get().Start(SCRATCH_FILE);
+		int64_t elapsed = TimeThreads(threadCount, pairsPerThread, RunScopePairs);
+		::PerfTimer::EventRecorder::get().End();
+		snprintf(name, sizeof(name), "scope_timer_threads_%d", threadCount);
+		Record(name, double(elapsed) / double(pairsPerThread * 2), false);
+
+		::PerfTimer::EventRecorder::get().Start(SCRATCH_FILE);
+		elapsed = TimeThreads(threadCount, pairsPerThread * 2, RunAddEvents);
+		::PerfTimer::EventRecorder::get().End();
+		snprintf(name, sizeof(name), "add_event_threads_%d", threadCount);
+		Record(name, double(elapsed) / double(pairsPerThread * 2), false);
+	}
+
+	void BenchWriteThroughput()
+	{
+		::PerfTimer::EventRecorder::get().Start(SCRATCH_FILE);
+		RunAddEvents(WRITE_EVENT_COUNT);
+		const int64_t start = ::PerfTimer::Now();
+		::PerfTimer::EventRecorder::get().End();
+		const int64_t elapsed = ::PerfTimer::Now() - start;
+		Record("write_throughput", double(WRITE_EVENT_COUNT) * 1e9 / double(elapsed), true);
+	}
+
+	int CompareBaseline(char const* const path)
+	{
+		FILE* file = fopen(path, "r");
+		if (file == nullptr)
+		{
+			fprintf(stderr, "Could not open baseline file '%s'\n", path);
+			return 1;
+		}
+
+		int regressions = 0;
+		char name[64];
+		double baselineValue;
+		while (fscanf(file, "%63s %lf", name, &baselineValue) == 2)
+		{
+			for (BenchResult const& result : Results())
+			{
+				if (strcmp(result.name, name) != 0)
+				{
+					continue;
+				}
+				const bool regressed = result.higherIsBetter
+					? result.value * REGRESSION_FACTOR < baselineValue
+					: result.value > baselineValue * REGRESSION_FACTOR;
+				if (regressed)
+				{
+					printf("REGRESSION %s: %.2f (baseline %.2f)\n", name, result.value, baselineValue);
+					++regressions;
+				}
+				break;
+			}
+		}
+		fclose(file);
+		return regressions == 0 ? 0 : 1;
+	}
+
+	void WriteBaseline(char const* const path)
+	{
+		FILE* file = fopen(path, "w");
+		if (file == nullptr)
+		{
+			fprintf(stderr, "Could not open baseline file '%s' for writing\n", path);
+			exit(1);
+		}
+		for (BenchResult const& result : Results())
+		{
+			fprintf(file, "%s %.2f\n", result.name, result.value);
+		}
+		fclose(file);
+	}
+}
+
+int main(int argc, char** argv)
+{
+#if PERFTIMER_MULTITHREADED
+	const int threadCounts[] = { 1, 4, 16, 64 };
+#else
+	const int threadCounts[] = { 1 };
+#endif
+
+	for (int threadCount : threadCounts)
+	{
+		BenchThreadCount(threadCount);
+	}
+	BenchWriteThroughput();
+	remove(SCRATCH_FILE);
+
+	int exitCode = 0;
+	for (int i = 1; i < argc - 1; ++i)
+	{
+		if (strcmp(argv[i], "--baseline") == 0)
+		{
+			exitCode = CompareBaseline(argv[i + 1]);
+		}
+		else if (strcmp(argv[i], "--write-baseline") == 0)
+		{
+			WriteBaseline(argv[i + 1]);
+		}
+	}
+	return exitCode;
+}
@@ -444,6 +444,19 @@ def _formatTime(totaltime):
 	msec = totaltime*1000
 	return "{:.2f}".format(msec)
 
+# Bit 62 set in a record's thread id marks it as an async context id - a fiber
+# or coroutine scope stitched by context rather than by the worker thread it
+# happened to run on. See PerfAsyncBegin in the C++ reference implementation.
+_ASYNC_CONTEXT_BIT = 1 << 62
+
+def _threadHeading(threadId):
+	name = PerfTimer.threadNames.get(threadId)
+	if name is not None:
+		return name
+	if isinstance(threadId, int) and threadId & _ASYNC_CONTEXT_BIT:
+		return "Async Context {}".format(threadId & (_ASYNC_CONTEXT_BIT - 1))
+	return "Worker Thread {}".format(threadId)
+
 class PerfTimer(object):
 	"""
 	Performance timer to collect performance stats on csbuild to aid in diagnosing slow builds.
@@ -457,6 +470,10 @@ class PerfTimer(object):
 	"""
 	perfQueue = deque()
 	annotations = deque()
+	counters = deque()
+	# Thread names registered in the capture (THREAD_NAME records); report
+	# headings use these in place of the raw thread id.
+	threadNames = {}
 	perfStack = threading.local()
 	minFrameTime = None
 	
@@ -512,6 +529,12 @@ class PerfTimer(object):
 			now = time.time()
 			PerfTimer.annotations.append((txt, threading.current_thread().ident, frame, now))
 
+	@staticmethod
+	def Counter(name, value, frame=None):
+		if _collecting:
+			now = time.time()
+			PerfTimer.counters.append((name, value, threading.current_thread().ident, frame, now))
+
 	@staticmethod
 	def PrintPerfReport(reportMode, output=None, name=None):
 		"""
@@ -577,6 +600,16 @@ class PerfTimer(object):
 				annotationsByFrame[frame].append(pair)
 			except IndexError:
 				break
+
+		countersByFrame = {}
+		allCounters = []
+		while True:
+			try:
+				counter = PerfTimer.counters.popleft()
+				allCounters.append(counter)
+				countersByFrame.setdefault(counter[3], deque()).append(counter)
+			except IndexError:
+				break
 				
 		if len(elementsByFrame) > 1 and reportMode == ReportMode.HTML:
 			if not os.path.exists(os.path.join(os.path.dirname(output), "frames")):
@@ -585,30 +618,80 @@ class PerfTimer(object):
 				print("Generating combined frame output...")
 			PerfTimer.perfQueue = allFramesQueue
 			#PerfTimer.annotations = allFramesAnnotations
+			PerfTimer.counters = deque(allCounters)
 			thisOutput = os.path.join(os.path.dirname(output), "frames", "_ALL.".join(os.path.basename(output).rsplit(".", 1)))
 			PerfTimer._printPerfReport(reportMode, thisOutput, None, name)
 
-		for key in sorted(elementsByFrame.keys()):
-			if key is not None:
-				if reportMode != ReportMode.HTML:
+		# A capture can mix unframed events (frame None, recorded before the first
+		# frame boundary) with framed ones; None sorts after the numbered frames.
+		frameKeys = sorted(elementsByFrame.keys(), key=lambda x: (x is None, x))
+		if len(elementsByFrame) > 1 and reportMode == ReportMode.HTML:
+			# Each frame's page is built from that frame's own slice of the
+			# capture and written to its own file, so the pages render in
+			# parallel; every page already aggregates and prints its threads
+			# separately, so the per-thread reports parallelize along with them.
+			jobs = []
+			for key in frameKeys:
+				thisOutput = os.path.join(os.path.dirname(output), "frames", "_{}.".format(key).join(os.path.basename(output).rsplit(".", 1)))
+				jobs.append((reportMode, thisOutput, key, name,
+					list(elementsByFrame[key]), list(annotationsByFrame[key]), list(countersByFrame.get(key, deque())),
+					dict(PerfTimer.threadNames)))
+			workers = 1
+			if __name__ == "__main__":
+				# Library callers (in-process profiling) keep the report on their
+				# own thread; forking workers out of a host application is rude.
+				try:
+					import multiprocessing
+					workers = min(multiprocessing.cpu_count(), len(jobs))
+				except ImportError:
+					workers = 1
+			if workers > 1:
+				print("Generating {} individual frame reports on {} workers...".format(len(jobs), workers))
+				pool = multiprocessing.Pool(workers)
+				try:
+					pool.map(_renderFrameReport, jobs, max(1, len(jobs) // (workers * 4)))
+				finally:
+					pool.close()
+					pool.join()
+			else:
+				for job in jobs:
+					if __name__ == "__main__":
+						sys.stdout.write("\rGenerating individual frame output for frame {}...".format(job[2]))
+					_renderFrameReport(job)
+		else:
+			for key in frameKeys:
+				if key is not None and reportMode != ReportMode.HTML:
 					output("==============================")
 					output("Frame #{}".format(key))
 					output("==============================")
-				elif __name__ == "__main__":
-					sys.stdout.write("\rGenerating individual frame output for frame {}...".format(key))
-			duration = latestByFrame[key] - earliestByFrame[key]
-			PerfTimer.perfQueue = elementsByFrame[key]
-			PerfTimer.annotations = annotationsByFrame[key]
-			thisOutput = output
-			if len(elementsByFrame) > 1 and reportMode == ReportMode.HTML:
-				thisOutput = os.path.join(os.path.dirname(output), "frames", "_{}.".format(key).join(os.path.basename(output).rsplit(".", 1)))
-			PerfTimer._printPerfReport(reportMode, thisOutput, key, name)
+				PerfTimer.perfQueue = elementsByFrame[key]
+				PerfTimer.annotations = annotationsByFrame[key]
+				PerfTimer.counters = countersByFrame.get(key, deque())
+				PerfTimer._printPerfReport(reportMode, output, key, name)
 
 		if len(elementsByFrame) > 1 and reportMode == ReportMode.HTML:
 			if __name__ == "__main__":
 				print("\nGenerating index file and performance graph...")
 			frameFile = os.path.join(os.path.dirname(output), "frames", "_${pn}.".join(os.path.basename(output).rsplit(".", 1))).replace("\\", "/")
 			allFramesFile = os.path.join(os.path.dirname(output), "frames", "_ALL.".join(os.path.basename(output).rsplit(".", 1))).replace("\\", "/")
+
+			# One line trace per counter name, averaged per frame, on a second y axis
+			# overlaying the frame-time bars. Unframed samples have no place on a
+			# frame axis, so they only appear in the per-frame report pages.
+			counterValuesByName = {}
+			for counter in allCounters:
+				if counter[3] is not None:
+					counterValuesByName.setdefault(counter[0], {}).setdefault(counter[3], []).append(counter[1])
+			counterTraces = ""
+			for counterName in sorted(counterValuesByName.keys()):
+				valuesByFrame = counterValuesByName[counterName]
+				frames = sorted(valuesByFrame.keys())
+				means = [sum(valuesByFrame[frame]) / len(valuesByFrame[frame]) for frame in frames]
+				counterTraces += "  {{\n    x: {},\n    y: {},\n    name: '{}',\n    type: 'scatter',\n    mode: 'lines+markers',\n    yaxis: 'y2'\n  }},\n".format(
+					frames, means, counterName.replace("'", "\\'"))
+			counterAxis = ""
+			if counterTraces:
+				counterAxis = "  yaxis2: { automargin: true, autorange: true, fixedrange: true, overlaying: 'y', side: 'right', title: { text: 'Counter value' } },\n"
 			html = """
 <html>
 <head>
@@ -633,8 +716,8 @@ html, body { height: 100%; }
   <iframe id="frameData" src=\"""" + allFramesFile + """\" style="height:calc(100% - 300px);">
   </iframe>
 <script type="text/javascript">
-const dataX = """ + str(list(sorted(elementsByFrame.keys()))) + """;
-const dataY = """ + str([(latestByFrame[key] - earliestByFrame[key]) * 1000 for key in sorted(elementsByFrame.keys())]) + """;
+const dataX = """ + str(sorted(key for key in elementsByFrame.keys() if key is not None)) + """;
+const dataY = """ + str([(latestByFrame[key] - earliestByFrame[key]) * 1000 for key in sorted(key for key in elementsByFrame.keys() if key is not None)]) + """;
 const data = [
   {
     x: dataX,
@@ -642,8 +725,9 @@ const data = [
     name: 'Performance',
     type: 'bar'
   },
-]
+""" + counterTraces + """]
 const layout = {
+""" + counterAxis + """
   autosize: true,
   xaxis: {
     automargin: true,
@@ -717,6 +801,10 @@ function singleClickHandler(data) {
 		while True:
 			try:
 				pair = PerfTimer.perfQueue.popleft()
+				# Sampled scopes carry their sample rate as an eighth element; each
+				# observation stands in for that many invocations, so the summed
+				# times and the count scale up by it. Min/max stay per-observation.
+				weight = pair[7] if len(pair) > 7 else 1
 				if reportMode == ReportMode.FLAT:
 					split = pair[0].rsplit("::", 1)
 					if len(split) == 2:
@@ -731,9 +819,9 @@ function singleClickHandler(data) {
 					)
 
 				fullreport.setdefault(pair[0], [0,0,0,0,0,999999999,999999999])
-				fullreport[pair[0]][Position.Inclusive] += pair[1]
-				fullreport[pair[0]][Position.Exclusive] += pair[2]
-				fullreport[pair[0]][Position.Count] += 1
+				fullreport[pair[0]][Position.Inclusive] += pair[1] * weight
+				fullreport[pair[0]][Position.Exclusive] += pair[2] * weight
+				fullreport[pair[0]][Position.Count] += weight
 				fullreport[pair[0]][Position.MaxInc] = max(pair[1], fullreport[pair[0]][Position.MaxInc])
 				fullreport[pair[0]][Position.MaxExc] = max(pair[2], fullreport[pair[0]][Position.MaxExc])
 				fullreport[pair[0]][Position.MinInc] = min(pair[1], fullreport[pair[0]][Position.MinInc])
@@ -741,9 +829,9 @@ function singleClickHandler(data) {
 
 				threadreport = threadreports.setdefault(pair[3], {})
 				threadreport.setdefault(pair[0], [0,0,0,0,0,999999999,999999999])
-				threadreport[pair[0]][Position.Inclusive] += pair[1]
-				threadreport[pair[0]][Position.Exclusive] += pair[2]
-				threadreport[pair[0]][Position.Count] += 1
+				threadreport[pair[0]][Position.Inclusive] += pair[1] * weight
+				threadreport[pair[0]][Position.Exclusive] += pair[2] * weight
+				threadreport[pair[0]][Position.Count] += weight
 				threadreport[pair[0]][Position.MaxInc] = max(pair[1], threadreport[pair[0]][Position.MaxInc])
 				threadreport[pair[0]][Position.MaxExc] = max(pair[2], threadreport[pair[0]][Position.MaxExc])
 				threadreport[pair[0]][Position.MinInc] = min(pair[1], threadreport[pair[0]][Position.MinInc])
@@ -759,6 +847,15 @@ function singleClickHandler(data) {
 				break
 			else:
 				annotations.append(pair)
+
+		counters = []
+		while True:
+			try:
+				counter = PerfTimer.counters.popleft()
+			except IndexError:
+				break
+			else:
+				counters.append(counter)
 				
 		if not fullreport:
 			return
@@ -849,7 +946,11 @@ function singleClickHandler(data) {
 
 					sortedKeys = sorted(report, reverse=True, key=lambda x: report[x][0] if reportMode == ReportMode.TREE else report[x][1])
 
-					threadScriptId = threadId.replace(" ", "_")
+					# Registered thread names can contain characters that aren't
+					# legal in the generated script identifiers, and worker pools
+					# commonly share one name - the numeric id keeps each thread's
+					# element ids and chart functions distinct.
+					threadScriptId = re.sub(r"\W", "_", "{}_{}".format(threadId, numericThreadId))
 					f.write(_blocks[0].format(threadScriptId, threadId))
 
 					f.write("\t\t\t\t\t\t['<{}_root>', null, 0, 0 ],\n".format(threadScriptId))
@@ -938,7 +1039,24 @@ function singleClickHandler(data) {
 					
 					if annotationData != '':
 						annotationData += '</ul></div>'
-							
+
+					counterStats = {}
+					for counter in counters:
+						counterName, value, counterThreadId, _, _ = counter
+						if counterThreadId == numericThreadId:
+							stats = counterStats.setdefault(counterName, [0, 0.0, None, None])
+							stats[0] += 1
+							stats[1] += value
+							stats[2] = value if stats[2] is None else min(stats[2], value)
+							stats[3] = value if stats[3] is None else max(stats[3], value)
+					if counterStats:
+						annotationData += '<div style="border:1px solid black; background-color:#cfc; width:100%;padding:10px;"><h3>Counters</h3><ul>'
+						for counterName in sorted(counterStats.keys()):
+							stats = counterStats[counterName]
+							annotationData += '<li><strong>{}:</strong> {} samples, min {:g}, avg {:g}, max {:g}</li>'.format(
+								counterName, stats[0], stats[2], stats[1] / stats[0], stats[3])
+						annotationData += '</ul></div>'
+
 					f.write(_blocks[2].format(threadScriptId, threadId, annotationData))
 
 				f.write(_htmlHeader.format(name, " (Frame #{})".format(frameId) if frameId is not None else ""))
@@ -947,7 +1065,7 @@ function singleClickHandler(data) {
 					if threadId == threading.current_thread().ident and __name__ != "__main__":
 						continue
 					else:
-						_printReportHtml(report, "Worker Thread {}".format(threadId), threadId)
+						_printReportHtml(report, _threadHeading(threadId), threadId)
 
 				if threading.current_thread().ident in threadreports and __name__ != "__main__":
 					_printReportHtml(threadreports[threading.current_thread().ident], "Main Thread", threading.current_thread().ident)
@@ -1071,24 +1189,44 @@ function singleClickHandler(data) {
 				if threadId == threading.current_thread().ident:
 					continue
 				else:
-					_printReport(report, "Worker Thread {}".format(threadId))
+					_printReport(report, _threadHeading(threadId))
 
 			_printReport(threadreports[threading.current_thread().ident], "Main Thread")
 			if len(threadreports) != 1:
 				_printReport(fullreport, "CUMULATIVE")
 
+
+# Renders one frame's report page; runs in a multiprocessing worker, so it must
+# be a module-level function and the job must carry that frame's slice of the
+# capture rather than relying on the parent's class-level queues.
+def _renderFrameReport(job):
+	reportMode, output, frameId, name, elements, annotations, counters, threadNames = job
+	PerfTimer.perfQueue = deque(elements)
+	PerfTimer.annotations = deque(annotations)
+	PerfTimer.counters = deque(counters)
+	PerfTimer.threadNames = threadNames
+	PerfTimer._printPerfReport(reportMode, output, frameId, name)
+
+
 if __name__ == "__main__":
 	class Operation:
 		Enter = 0
 		Exit = 1
 		Note = 2
+		CounterInt = 3
+		CounterFloat = 4
+		FrameBoundary = 5
+		SampledEnter = 6
+		ThreadName = 7
 	if len(sys.argv) < 2:
-		print("Syntax: perf_timer.py <metricsFilename> <outputHtmlFilename> <applicationName> [minFrameTime (ms)]")
+		print("Syntax: perf_timer.py <metricsFilename|--listen port> <outputHtmlFilename> <applicationName> [minFrameTime (ms)]")
 		sys.exit(1)
 	if sys.argv[1] == "test":
 		if len(sys.argv) != 4 and len(sys.argv) != 5:
 			print("Syntax: perf_timer.py test <outputHtmlFilename> <applicationName> [threaded]")
 			sys.exit(1)
+		outputFilename = sys.argv[2]
+		applicationName = sys.argv[3]
 		threads = 1
 		if len(sys.argv) == 5 and sys.argv[4] == "threaded":
 			threads = 3
@@ -1151,53 +1289,485 @@ if __name__ == "__main__":
 						f.write(data[4])
 		sys.exit(0)
 	else:
-		if len(sys.argv) != 4 and len(sys.argv) != 5:
-			print("Syntax: perf_timer.py metricsFilename outputHtmlFilename applicationName [minFrameTime (ms)]")
-			sys.exit(1)
-		if len(sys.argv) == 5:
-			PerfTimer.setMinFrameTime(float(sys.argv[4]))
-		with open(sys.argv[1], "rb") as f:
-			import struct
-
+		# --frame N narrows the report to a single frame. Captures written by a
+		# current recorder carry an index footer that locates each frame's bytes,
+		# so only that frame is parsed; older files fall back to a full parse
+		# with a filter. Strip the flag before the positional arguments.
+		frameFilter = None
+		if len(sys.argv) >= 3 and sys.argv[1] == "--frame":
+			frameFilter = int(sys.argv[2])
+			del sys.argv[1:3]
+		listenMode = sys.argv[1] == "--listen"
+		if listenMode:
+			if len(sys.argv) != 5 and len(sys.argv) != 6:
+				print("Syntax: perf_timer.py --listen <port|unix socket path> outputHtmlFilename applicationName [minFrameTime (ms)]")
+				sys.exit(1)
+			if len(sys.argv) == 6:
+				PerfTimer.setMinFrameTime(float(sys.argv[5]))
+			outputFilename = sys.argv[3]
+			applicationName = sys.argv[4]
+			# Accept one recorder connection (a C++ build with PERFTIMER_SOCKET
+			# calling StartSocket) and buffer its stream until it disconnects. The
+			# bytes are identical to the on-disk format, except that the header
+			# count is a placeholder - a socket can't seek back to patch it - so
+			# parsing runs to the end of the stream instead of trusting the count.
+			import io
+			import socket as socketmodule
+			address = sys.argv[2]
+			if "/" in address:
+				if os.path.exists(address):
+					os.remove(address)
+				server = socketmodule.socket(socketmodule.AF_UNIX, socketmodule.SOCK_STREAM)
+				server.bind(address)
+			else:
+				server = socketmodule.socket(socketmodule.AF_INET, socketmodule.SOCK_STREAM)
+				server.setsockopt(socketmodule.SOL_SOCKET, socketmodule.SO_REUSEADDR, 1)
+				server.bind(("", int(address)))
+			server.listen(1)
+			print("Listening on {}...".format(address))
+			connection, _ = server.accept()
+			print("Recorder connected, receiving events...")
+			f = io.BytesIO()
+			while True:
+				data = connection.recv(1 << 16)
+				if not data:
+					break
+				f.write(data)
+			connection.close()
+			server.close()
+			if "/" in address:
+				os.remove(address)
+			print("Recorder disconnected after {} bytes.".format(f.tell()))
+			f.seek(0, os.SEEK_SET)
+		else:
+			if len(sys.argv) != 4 and len(sys.argv) != 5:
+				print("Syntax: perf_timer.py [--frame N] metricsFilename outputHtmlFilename applicationName [minFrameTime (ms)]")
+				sys.exit(1)
+			if len(sys.argv) == 5:
+				PerfTimer.setMinFrameTime(float(sys.argv[4]))
+			outputFilename = sys.argv[2]
+			applicationName = sys.argv[3]
+			f = open(sys.argv[1], "rb")
+		import pickle
+		import struct
+
+		with f:
 			print("Processing file")
-			if struct.unpack("<L", f.read(4))[0] == 0xFA57:
-				print("Found FA57 header. Processing as binary...")
-				recordings = []
-				count = struct.unpack("<L", f.read(4))[0]
-				print("File provides {} events. Loading data...".format(count))
-				i = 0
-				for _ in range(count):
-					i += 1
-					if i % 10000 == 0:
-						sys.stdout.write("\r... {} ({:.1f}%)".format(i, i/count*100))
-					line = list(struct.unpack("<bQiQH", f.read(1+8+4+8+2)))
-					name = b""
-					name = f.read(line[4])
-					line[4] = name.replace(b"::", b".")
-					recordings.append(line)
-				print("\rData loaded, processing...")
+			# Parsing out of one flat buffer - a memory mapping for files, the
+			# received bytes for live mode - with precompiled Structs is several
+			# times faster than issuing two or three f.read calls per event, and
+			# the generators below hand each event straight to the processing
+			# loop, so no per-event list of the whole capture is ever built.
+			if listenMode:
+				data = f.getvalue()
+			else:
+				import mmap
+				data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+		eventPrefix = struct.Struct("<bQiQH")
+		tagByte = struct.Struct("<B")
+		nameLength = struct.Struct("<H")
+		counterInt = struct.Struct("<q")
+		counterFloat = struct.Struct("<d")
+
+		def parseV1(data, count, start=8):
+			# Names repeat millions of times in a big capture; the cache pays the
+			# :: -> . rewrite once per distinct name instead of once per event.
+			names = {}
+			unpack = eventPrefix.unpack_from
+			end = len(data)
+			offset = start
+			produced = 0
+			while count is None or produced < count:
+				if offset + 23 > end:
+					break
+				operation, threadId, frameId, timestamp, nameLen = unpack(data, offset)
+				offset += 23
+				if offset + nameLen > end:
+					break
+				raw = data[offset:offset + nameLen]
+				offset += nameLen
+				name = names.get(raw)
+				if name is None:
+					name = raw.replace(b"::", b".")
+					names[raw] = name
+				if operation == 3 or operation == 6:
+					if offset + 8 > end:
+						break
+					name = (name, counterInt.unpack_from(data, offset)[0])
+					offset += 8
+				elif operation == 4:
+					if offset + 8 > end:
+						break
+					name = (name, counterFloat.unpack_from(data, offset)[0])
+					offset += 8
+				produced += 1
+				yield operation, threadId, frameId, timestamp, name
+			if count is None:
+				print("Stream ended after {} complete events.".format(produced))
+
+		def parseV2(data, count, start=8, names=None):
+			# Format v2: block names are interned. A record tagged 255 defines the
+			# next name in the table; events reference names by index. Parsing a
+			# mid-file range needs the table preseeded (from the index footer)
+			# because the defining records may sit outside the range; any tag 255
+			# inside the range then appends a duplicate past the preseeded ids,
+			# which nothing references.
+			if names is None:
+				names = []
+			unpackEvent = struct.Struct("<QiQL").unpack_from
+			unpackTag = tagByte.unpack_from
+			unpackLen = nameLength.unpack_from
+			end = len(data)
+			offset = start
+			produced = 0
+			while count is None or produced < count:
+				if offset + 1 > end:
+					break
+				tag = unpackTag(data, offset)[0]
+				offset += 1
+				if tag == 255:
+					if offset + 2 > end:
+						break
+					nameLen = unpackLen(data, offset)[0]
+					offset += 2
+					if offset + nameLen > end:
+						break
+					names.append(data[offset:offset + nameLen].replace(b"::", b"."))
+					offset += nameLen
+					continue
+				if offset + 24 > end:
+					break
+				threadId, frameId, timestamp, nameIndex = unpackEvent(data, offset)
+				offset += 24
+				name = names[nameIndex]
+				if tag == 3 or tag == 6:
+					if offset + 8 > end:
+						break
+					name = (name, counterInt.unpack_from(data, offset)[0])
+					offset += 8
+				elif tag == 4:
+					if offset + 8 > end:
+						break
+					name = (name, counterFloat.unpack_from(data, offset)[0])
+					offset += 8
+				produced += 1
+				yield tag, threadId, frameId, timestamp, name
+			if count is None:
+				print("Stream ended after {} complete events.".format(produced))
+
+		def parseV3(data, count, start=8, names=None):
+			# Format v3: chunked. A record tagged 254 sets the thread id and the
+			# absolute timestamp base, 253 sets the frame id, and 255 defines the
+			# next name in the table; events carry only a 32-bit delta from the
+			# chunk base and a 16-bit name index. The writer opens every indexed
+			# range with fresh 254/253 records, so a range parses standalone when
+			# the name table is preseeded from the footer.
+			if names is None:
+				names = []
+			chunkThreadId = 0
+			chunkBase = 0
+			frameId = -1
+			unpackEvent = struct.Struct("<LH").unpack_from
+			unpackChunk = struct.Struct("<qq").unpack_from
+			unpackFrame = struct.Struct("<i").unpack_from
+			unpackTag = tagByte.unpack_from
+			unpackLen = nameLength.unpack_from
+			end = len(data)
+			offset = start
+			produced = 0
+			while count is None or produced < count:
+				if offset + 1 > end:
+					break
+				tag = unpackTag(data, offset)[0]
+				offset += 1
+				if tag == 255:
+					if offset + 2 > end:
+						break
+					nameLen = unpackLen(data, offset)[0]
+					offset += 2
+					if offset + nameLen > end:
+						break
+					names.append(data[offset:offset + nameLen].replace(b"::", b"."))
+					offset += nameLen
+					continue
+				if tag == 254:
+					if offset + 16 > end:
+						break
+					chunkThreadId, chunkBase = unpackChunk(data, offset)
+					offset += 16
+					continue
+				if tag == 253:
+					if offset + 4 > end:
+						break
+					frameId = unpackFrame(data, offset)[0]
+					offset += 4
+					continue
+				if offset + 6 > end:
+					break
+				delta, nameIndex = unpackEvent(data, offset)
+				offset += 6
+				name = names[nameIndex]
+				if tag == 3 or tag == 6:
+					if offset + 8 > end:
+						break
+					name = (name, counterInt.unpack_from(data, offset)[0])
+					offset += 8
+				elif tag == 4:
+					if offset + 8 > end:
+						break
+					name = (name, counterFloat.unpack_from(data, offset)[0])
+					offset += 8
+				produced += 1
+				yield tag, chunkThreadId, frameId, chunkBase + delta, name
+			if count is None:
+				print("Stream ended after {} complete events.".format(produced))
+
+		def decompressLZ4(src):
+			# Standard LZ4 block format: a token byte holds the literal and match
+			# run lengths (15 means the length continues in 255-runs), followed by
+			# the literals and a 2-byte match offset. Matches may overlap their own
+			# output, so overlapping copies go forward piece by piece.
+			dst = bytearray()
+			i = 0
+			end = len(src)
+			while i < end:
+				token = src[i]
+				i += 1
+				literals = token >> 4
+				if literals == 15:
+					while True:
+						run = src[i]
+						i += 1
+						literals += run
+						if run != 255:
+							break
+				dst += src[i:i + literals]
+				i += literals
+				if i >= end:
+					break
+				offset = src[i] | (src[i + 1] << 8)
+				i += 2
+				matchLength = (token & 15) + 4
+				if token & 15 == 15:
+					while True:
+						run = src[i]
+						i += 1
+						matchLength += run
+						if run != 255:
+							break
+				start = len(dst) - offset
+				while matchLength > 0:
+					piece = min(matchLength, len(dst) - start)
+					dst += dst[start:start + piece]
+					start += piece
+					matchLength -= piece
+			return dst
+
+		def readFrameIndex(data):
+			# The recorder appends an FA5B footer after the last event: per-frame
+			# byte ranges, frame boundary timestamps, and (v2/v3) the full name
+			# table, closed by a 12-byte trailer of footer offset plus the magic
+			# again. Offsets are relative to the first record byte, which in this
+			# flat buffer sits at 8 - uniformly, since the compressed rebuild
+			# above reconstructs exactly that layout. Returns (ranges,
+			# boundaries, names) or None when there is no footer (older files,
+			# socket streams, crash dumps).
+			if len(data) < 32:
+				return None
+			footerStart, trailerMagic = struct.unpack_from("<qL", data, len(data) - 12)
+			if trailerMagic != 0xFA5B:
+				return None
+			offset = 8 + footerStart
+			if offset < 8 or offset + 20 > len(data):
+				return None
+			magic, version, rangeCount, boundaryCount, nameCount = struct.unpack_from("<Liiii", data, offset)
+			if magic != 0xFA5B or version != 1:
+				return None
+			offset += 20
+			unpackRange = struct.Struct("<iqi")
+			ranges = []
+			for _ in range(rangeCount):
+				ranges.append(unpackRange.unpack_from(data, offset))
+				offset += 16
+			unpackBoundary = struct.Struct("<iq")
+			boundaries = []
+			for _ in range(boundaryCount):
+				boundaries.append(unpackBoundary.unpack_from(data, offset))
+				offset += 12
+			names = []
+			for _ in range(nameCount):
+				nameLen = nameLength.unpack_from(data, offset)[0]
+				offset += 2
+				names.append(data[offset:offset + nameLen].replace(b"::", b"."))
+				offset += nameLen
+			return ranges, boundaries, names
+
+		# Sidecar report cache. Parsing a large capture and replaying it into the
+		# aggregation queues dwarfs the report rendering itself, and the same
+		# capture tends to be opened repeatedly - by different people, for
+		# different frames. After a full parse the four aggregation structures
+		# (scope queue, annotations, counters, thread names) are pickled to
+		# <capture>.ptcache next to the capture; when the capture is opened again
+		# the cache loads in place of the parse, and a --frame view filters the
+		# cached scopes by their frame stamp instead of touching the capture at
+		# all. The capture's size and mtime are stored alongside so a rewritten
+		# capture invalidates its cache.
+		reportCacheVersion = 1
+
+		def loadReportCache(metricsFilename):
+			path = metricsFilename + ".ptcache"
+			if not os.path.exists(path):
+				return None
+			try:
+				with open(path, "rb") as cacheFile:
+					cached = pickle.load(cacheFile)
+				stat = os.stat(metricsFilename)
+				if cached["version"] != reportCacheVersion or cached["size"] != stat.st_size or cached["mtime"] != stat.st_mtime:
+					print("Report cache {} is stale; reparsing.".format(path))
+					return None
+			except Exception:
+				print("Report cache {} is unreadable; reparsing.".format(path))
+				return None
+			return cached
+
+		def writeReportCache(metricsFilename):
+			path = metricsFilename + ".ptcache"
+			stat = os.stat(metricsFilename)
+			payload = {
+				"version": reportCacheVersion,
+				"size": stat.st_size,
+				"mtime": stat.st_mtime,
+				"scopes": list(PerfTimer.perfQueue),
+				"annotations": list(PerfTimer.annotations),
+				"counters": list(PerfTimer.counters),
+				"threadNames": dict(PerfTimer.threadNames),
+			}
+			try:
+				# Write-then-rename so an interrupted write can't leave a torn
+				# cache for the next run to trip over.
+				with open(path + ".tmp", "wb") as cacheFile:
+					pickle.dump(payload, cacheFile, 2)
+				os.rename(path + ".tmp", path)
+			except (IOError, OSError) as e:
+				print("Could not write report cache {}: {}".format(path, e))
+				return
+			print("Wrote report cache {}; the next report from this capture skips the parse.".format(path))
+
+		totalEvents = None
+		reportCache = None if listenMode else loadReportCache(sys.argv[1])
+		if reportCache is not None:
+			scopes = reportCache["scopes"]
+			annotations = reportCache["annotations"]
+			counters = reportCache["counters"]
+			if frameFilter is not None:
+				# Scopes were stamped with their frame at replay time; None marks
+				# events outside any frame, which every view includes.
+				scopes = [s for s in scopes if s[4] == frameFilter or s[4] is None]
+				annotations = [a for a in annotations if a[2] == frameFilter or a[2] is None]
+				counters = [c for c in counters if c[3] == frameFilter or c[3] is None]
+			PerfTimer.perfQueue = deque(scopes)
+			PerfTimer.annotations = deque(annotations)
+			PerfTimer.counters = deque(counters)
+			PerfTimer.threadNames = dict(reportCache["threadNames"])
+			recordings = ()
+			print("Loaded report cache with {} scopes; skipping the parse.".format(len(scopes)))
+		else:
+			magic = struct.unpack_from("<L", data, 0)[0] if len(data) >= 8 else 0
+			if magic == 0xFA5A and len(data) >= 12:
+				# Compressed container: magic, count, the inner format's magic, then
+				# framed chunks (codec byte, raw size, stored size, payload). The
+				# decompressed chunks concatenate into an ordinary capture body, so
+				# rebuilding the inner header here lets the usual paths below take
+				# over. A truncated final chunk (a live stream cut off mid-write) is
+				# simply dropped, like a truncated final record in a raw stream.
+				print("Found FA5A header. Decompressing...")
+				rebuilt = bytearray(data[8:12]) + bytearray(data[4:8])
+				chunkHeader = struct.Struct("<BLL")
+				offset = 12
+				while offset + 9 <= len(data):
+					codec, rawSize, storedSize = chunkHeader.unpack_from(data, offset)
+					offset += 9
+					if offset + storedSize > len(data):
+						break
+					payload = data[offset:offset + storedSize]
+					offset += storedSize
+					if codec == 0:
+						rebuilt += payload
+					elif codec == 1:
+						rebuilt += decompressLZ4(payload)
+					else:
+						print("Unknown codec {} in chunk framing; ignoring the rest of the file.".format(codec))
+						break
+				data = bytes(rebuilt)
+				magic = struct.unpack_from("<L", data, 0)[0] if len(data) >= 8 else 0
+			if magic == 0xFA57 or magic == 0xFA58 or magic == 0xFA59:
+				flavor = { 0xFA57: "", 0xFA58: " (v2, interned names)", 0xFA59: " (v3, chunked)" }[magic]
+				print("Found {:X} header. Processing as binary{}...".format(magic, flavor))
+				count = struct.unpack_from("<L", data, 4)[0]
+				if listenMode:
+					# The live header's count is a placeholder; read to end of stream.
+					count = None
+					print("Live stream. Loading data...")
+				else:
+					totalEvents = count
+					print("File provides {} events. Loading data...".format(count))
+				index = None
+				if frameFilter is not None:
+					index = readFrameIndex(data)
+					if index is None:
+						print("No frame index footer; falling back to a full parse with a frame filter.")
+				if index is not None:
+					ranges, boundaries, footerNames = index
+					# Ranges tagged -1 hold the preamble (thread names); one frame can
+					# own several ranges when per-thread chains scatter its events.
+					selected = [r for r in ranges if r[0] == frameFilter or r[0] < 0]
+					totalEvents = sum(r[2] for r in selected)
+					print("Frame index: {} of {} ranges cover frame {} ({} events).".format(len(selected), len(ranges), frameFilter, totalEvents))
+					import itertools
+					if magic == 0xFA57:
+						recordings = itertools.chain.from_iterable(parseV1(data, r[2], 8 + r[1]) for r in selected)
+					elif magic == 0xFA58:
+						recordings = itertools.chain.from_iterable(parseV2(data, r[2], 8 + r[1], list(footerNames)) for r in selected)
+					else:
+						recordings = itertools.chain.from_iterable(parseV3(data, r[2], 8 + r[1], list(footerNames)) for r in selected)
+				else:
+					if magic == 0xFA57:
+						recordings = parseV1(data, count)
+					elif magic == 0xFA58:
+						recordings = parseV2(data, count)
+					else:
+						recordings = parseV3(data, count)
+					if frameFilter is not None:
+						recordings = (r for r in recordings if r[2] == frameFilter or r[2] < 0)
+						totalEvents = None
 
 			else:
-				f.seek(0, os.SEEK_SET)
 				import json
 				print("File is not binary. Processing as JSON...")
-				recordings = json.load(f)
-				print("File provides {} events, processing...".format(len(recordings)))
+				recordings = json.loads(bytes(data[:]))
+				if frameFilter is not None:
+					recordings = [r for r in recordings if r[2] == frameFilter or r[2] < 0]
+				totalEvents = len(recordings)
+				print("File provides {} events, processing...".format(totalEvents))
 
 		stacks = {}
 		lastEnd = {}
-		i = 0
-		for recording in recordings:
-			i += 1
-			if i % 10000 == 0:
-				sys.stdout.write("\r... {} ({:.1f}%)".format(i, i/len(recordings)*100))
+
+		def _applyRecording(recording):
 			operation, threadId, frameId, timestamp, name = recording
 			timestamp /= 1000 * 1000 * 1000
 			if sys.version_info[0] >= 3 and isinstance(name, bytes):
 				name = name.decode("ascii")
 
-			if operation == Operation.Enter:
+			if operation == Operation.Enter or operation == Operation.SampledEnter:
+				sampleRate = 1
+				if operation == Operation.SampledEnter:
+					name, sampleRate = name
+					if sys.version_info[0] >= 3 and isinstance(name, bytes):
+						name = name.decode("ascii")
 				timer = PerfTimer(name, frameId if frameId >= 0 else None)
+				timer.sampleRate = sampleRate
 				timer.threadId = threadId
 				try:
 					prev = stacks[threadId][-1]
@@ -1211,7 +1781,7 @@ if __name__ == "__main__":
 						lastEnd.setdefault(threadId, {})[frameId] = None
 						duration = timestamp - lastEndThisFrameAndThread
 						PerfTimer.perfQueue.append(
-							("<unknown>", duration, duration, threadId, frameId, lastEndThisFrameAndThread, timestamp))
+							("<unknown>", duration, duration, threadId, frameId if frameId >= 0 else None, lastEndThisFrameAndThread, timestamp))
 						
 					stacks[threadId] = [timer]
 
@@ -1219,7 +1789,12 @@ if __name__ == "__main__":
 				timer.excstart = timestamp
 
 			elif operation == Operation.Exit:
-				timer = stacks[threadId][-1]
+				try:
+					timer = stacks[threadId][-1]
+				except (KeyError, IndexError):
+					# Flight-recorder dumps can begin mid-stack; drop exit events whose
+					# enters were overwritten before the dump.
+					return
 				try:
 					prev = stacks[threadId][-2]
 					prev.excstart = timestamp
@@ -1230,15 +1805,57 @@ if __name__ == "__main__":
 				timer.exclusive += timestamp - timer.excstart
 				timer.inclusive = timestamp - timer.incstart
 
-				PerfTimer.perfQueue.append(
-					(timer.scopeName, timer.inclusive, timer.exclusive, timer.threadId, timer.frame, timer.incstart, timestamp))
+				if timer.sampleRate > 1:
+					# Sampled scopes carry their rate through to aggregation so the
+					# report can scale their times and counts back up.
+					PerfTimer.perfQueue.append(
+						(timer.scopeName, timer.inclusive, timer.exclusive, timer.threadId, timer.frame, timer.incstart, timestamp, timer.sampleRate))
+				else:
+					PerfTimer.perfQueue.append(
+						(timer.scopeName, timer.inclusive, timer.exclusive, timer.threadId, timer.frame, timer.incstart, timestamp))
 				stacks[threadId].pop()
 			elif operation == Operation.Note:
-				PerfTimer.annotations.append((name, threadId, frameId, timestamp))
+				PerfTimer.annotations.append((name, threadId, frameId if frameId >= 0 else None, timestamp))
+			elif operation == Operation.CounterInt or operation == Operation.CounterFloat:
+				counterName, value = name
+				if sys.version_info[0] >= 3 and isinstance(counterName, bytes):
+					counterName = counterName.decode("ascii")
+				PerfTimer.counters.append((counterName, value, threadId, frameId if frameId >= 0 else None, timestamp))
+			elif operation == Operation.FrameBoundary:
+				# Recorders that use frame marks stamp every event with its frame
+				# already; the boundary event itself needs no separate handling.
+				pass
+			elif operation == Operation.ThreadName:
+				PerfTimer.threadNames[threadId] = name
 			else:
 				print("\rInvalid operation: {}".format(operation))
 				exit(1)
-				
-		print("\rFinished processing {} events. Generating output...".format(len(recordings)))
 
-	PerfTimer.PrintPerfReport(ReportMode.HTML, sys.argv[2], sys.argv[3])
+		# A fiber's enter and its exit can sit in different threads' buffer
+		# chains, which are written out one thread at a time, so an async
+		# context's records are only correctly ordered once sorted by timestamp.
+		# They are set aside during the main pass and replayed sorted;
+		# everything else streams straight through.
+		if reportCache is None:
+			asyncRecordings = []
+			i = 0
+			for recording in recordings:
+				i += 1
+				if i % 10000 == 0 and totalEvents:
+					sys.stdout.write("\r... {} ({:.1f}%)".format(i, i/totalEvents*100))
+				if recording[1] & _ASYNC_CONTEXT_BIT:
+					asyncRecordings.append(recording)
+					continue
+				_applyRecording(recording)
+			for recording in sorted(asyncRecordings, key=lambda recording: recording[3]):
+				_applyRecording(recording)
+
+			print("\rFinished processing {} events. Generating output...".format(i))
+			if not listenMode and frameFilter is None:
+				# Only a full parse is worth caching; a --frame parse holds one
+				# frame's slice, and a live stream has no file to sit next to.
+				writeReportCache(sys.argv[1])
+		else:
+			print("Generating output from the cache...")
+
+	PerfTimer.PrintPerfReport(ReportMode.HTML, outputFilename, applicationName)